@@ -164,5 +164,5 @@ set(LWIP_SOURCE_FILES
 
     # patch files
     ${LWIPARCH}/perf.c
-    ${LWIPARCH}/sys_arch.c
+    src/sys_arch.c
     )
@@ -62,18 +62,43 @@
    ---------- Memory options ----------
    ------------------------------------
 */
+/**
+ * MEMP_POOL_MODE==1: preallocate every memp type (TCP PCBs, segments, pbufs,
+ * UDP PCBs, ...) and the mem_malloc() heap as fixed-size pools. Each pool is
+ * one cache-aligned static slab with an O(1) freelist, bounded by its
+ * MEMP_NUM_* budget below, and accounted in lwip_stats.memp[]. When a budget
+ * runs out the allocation fails (tcp_write returns ERR_MEM, the tun/tap input
+ * pbuf is dropped) and TCP backs off instead of the process growing.
+ * MEMP_POOL_MODE==0: send every allocation to libc malloc.
+ */
+#ifndef MEMP_POOL_MODE
+#define MEMP_POOL_MODE                  1
+#endif
+
 /**
  * MEM_ALIGNMENT: should be set to the alignment of the CPU
  *    4 byte alignment -> #define MEM_ALIGNMENT 4
  *    2 byte alignment -> #define MEM_ALIGNMENT 2
  */
+#if MEMP_POOL_MODE
+#define MEM_ALIGNMENT                   8
+#else
 #define MEM_ALIGNMENT                   1
+#endif
+
+/**
+ * MEMP_CACHE_LINE: alignment of the base of every static memp slab.
+ */
+#define MEMP_CACHE_LINE                 64
+#define LWIP_DECLARE_MEMORY_ALIGNED(variable_name, size) \
+    u8_t variable_name[LWIP_MEM_ALIGN_BUFFER(size)] __attribute__((aligned(MEMP_CACHE_LINE)))
 
 /**
  * MEM_SIZE: the size of the heap memory. If the application will send
  * a lot of data that needs to be copied, this should be set high.
+ * Unused while the heap is served by pools (MEM_USE_POOLS) or libc.
  */
-#define MEM_SIZE                        1024 * 1024 * 1024 * 8
+#define MEM_SIZE                        (32 * 1024 * 1024)
 
 
 /*
@@ -86,38 +111,59 @@
  * If the application sends a lot of data out of ROM (or other static memory),
  * this should be set high.
  */
+#ifndef MEMP_NUM_PBUF
+#if MEMP_POOL_MODE
+/* one per segment queued by tcp_write without TCP_WRITE_FLAG_COPY */
+#define MEMP_NUM_PBUF                   8192
+#else
 #define MEMP_NUM_PBUF                   1024
+#endif
+#endif
 
 /**
  * MEMP_NUM_RAW_PCB: Number of raw connection PCBs
  * (requires the LWIP_RAW option)
  */
+#ifndef MEMP_NUM_RAW_PCB
 #define MEMP_NUM_RAW_PCB                1024
+#endif
 
 /**
  * MEMP_NUM_UDP_PCB: the number of UDP protocol control blocks. One
  * per active UDP "connection".
  * (requires the LWIP_UDP option)
  */
+#ifndef MEMP_NUM_UDP_PCB
 #define MEMP_NUM_UDP_PCB                1024
+#endif
 
 /**
  * MEMP_NUM_TCP_PCB: the number of simulatenously active TCP connections.
  * (requires the LWIP_TCP option)
  */
+#ifndef MEMP_NUM_TCP_PCB
 #define MEMP_NUM_TCP_PCB                1024
+#endif
 
 /**
  * MEMP_NUM_TCP_PCB_LISTEN: the number of listening TCP connections.
  * (requires the LWIP_TCP option)
  */
+#ifndef MEMP_NUM_TCP_PCB_LISTEN
 #define MEMP_NUM_TCP_PCB_LISTEN         1024
+#endif
 
 /**
  * MEMP_NUM_TCP_SEG: the number of simultaneously queued TCP segments.
  * (requires the LWIP_TCP option)
  */
+#ifndef MEMP_NUM_TCP_SEG
+#if MEMP_POOL_MODE
+#define MEMP_NUM_TCP_SEG                8192
+#else
 #define MEMP_NUM_TCP_SEG                1024
+#endif
+#endif
 
 /**
  * MEMP_NUM_ARP_QUEUE: the number of simulateously queued outgoing
@@ -164,8 +210,29 @@
 
 /**
  * PBUF_POOL_SIZE: the number of buffers in the pbuf pool.
+ * Every packet read from the tun/tap device lands in one of these.
  */
+#ifndef PBUF_POOL_SIZE
+#if MEMP_POOL_MODE
+#define PBUF_POOL_SIZE                  4096
+#else
 #define PBUF_POOL_SIZE                  1024 * 1024
+#endif
+#endif
+
+/**
+ * MEM_POOL_*_NUM: budgets of the pools serving mem_malloc() (PBUF_RAM
+ * payloads, see lwippools.h). Only used with MEMP_POOL_MODE.
+ */
+#ifndef MEM_POOL_SMALL_NUM
+#define MEM_POOL_SMALL_NUM              1024
+#endif
+#ifndef MEM_POOL_MEDIUM_NUM
+#define MEM_POOL_MEDIUM_NUM             8192
+#endif
+#ifndef MEM_POOL_LARGE_NUM
+#define MEM_POOL_LARGE_NUM              16384
+#endif
 
 /*
    ---------------------------------
@@ -347,6 +414,26 @@
  */
 #define LWIP_TCP                        1
 
+/**
+ * TCP_LISTEN_BACKLOG==1: bound the number of half open connections
+ * (SYN_RCVD, not yet accepted) of a listening pcb, see tcp_raw_init.
+ */
+#define TCP_LISTEN_BACKLOG              1
+
+/**
+ * TCP_QUEUE_OOSEQ==1: TCP will queue segments that arrive out of order.
+ * TCP_OOSEQ_MAX_BYTES/TCP_OOSEQ_MAX_PBUFS: hard per pcb caps enforced by lwip
+ * on every insert. The runtime per connection and global limits are the
+ * ooseq_* config keys, enforced by tcp_ooseq.cpp.
+ */
+#define TCP_QUEUE_OOSEQ                 1
+#ifndef TCP_OOSEQ_MAX_BYTES
+#define TCP_OOSEQ_MAX_BYTES             (TCP_WND)
+#endif
+#ifndef TCP_OOSEQ_MAX_PBUFS
+#define TCP_OOSEQ_MAX_PBUFS             64
+#endif
+
 /*
    ----------------------------------
    ---------- Pbuf options ----------
@@ -401,6 +488,12 @@
  */
 #define LWIP_STATS                      1
 #define MEM_STATS                       1
+#define MEMP_STATS                      1
+
+/**
+ * LWIP_STATS_DISPLAY==1: Compile in stats_display(), dumped on SIGUSR1.
+ */
+#define LWIP_STATS_DISPLAY              1
 
 /*
    ---------------------------------------
@@ -448,11 +541,20 @@
 /* hook config end */
 
 
+#if MEMP_POOL_MODE
+#define MEM_USE_POOLS 1
+#define MEM_USE_POOLS_TRY_BIGGER_POOL 1
+#define MEMP_USE_CUSTOM_POOLS 1
+
+#define MEMP_MEM_MALLOC 0
+#define MEM_LIBC_MALLOC 0
+#else
 #define MEM_USE_POOLS 0
 #define MEMP_USE_CUSTOM_POOLS 0
 
 #define MEMP_MEM_MALLOC 1
 #define MEM_LIBC_MALLOC 1
+#endif
 
 /*
  * We reduce the maximum segment lifetime from one minute to one second to
@@ -474,7 +576,12 @@
 #define TCP_MSS 1460
 #define TCP_WND 0xFFFF
 #define TCP_SND_BUF 65535
+/* the segment pool is shared, so one pcb must not be able to queue all of it */
+#if MEMP_POOL_MODE
+#define TCP_SND_QUEUELEN (4 * (TCP_SND_BUF)/(TCP_MSS))
+#else
 #define TCP_SND_QUEUELEN (1024 * (TCP_SND_BUF)/(TCP_MSS))
+#endif
 
 #define LWIP_NOASSERT 0
 
@@ -0,0 +1,22 @@
+/**
+ * @file
+ *
+ * lwIP custom memory pools, used with MEMP_POOL_MODE (see lwipopts.h)
+ */
+/* No include guard: memp_std.h expands this file once per pool list. */
+
+/*
+ * mem_malloc() is served from these pools when MEM_USE_POOLS is on. They
+ * must be listed in increasing order of size. The sizes follow the
+ * PBUF_RAM allocations made by the stack and the relays:
+ *   small:  lwip structs allocated with mem_malloc
+ *   medium: header only segments (ACK, FIN, RST)
+ *   large:  a full TCP_MSS segment or a relayed UDP datagram
+ */
+#if MEM_USE_POOLS
+LWIP_MALLOC_MEMPOOL_START
+LWIP_MALLOC_MEMPOOL(MEM_POOL_SMALL_NUM, 256)
+LWIP_MALLOC_MEMPOOL(MEM_POOL_MEDIUM_NUM, (PBUF_LINK_HLEN + 256))
+LWIP_MALLOC_MEMPOOL(MEM_POOL_LARGE_NUM, (PBUF_LINK_HLEN + 2048))
+LWIP_MALLOC_MEMPOOL_END
+#endif /* MEM_USE_POOLS */
@@ -13,10 +13,15 @@
 #include "lwip/timeouts.h"
 #include "lwip/ip.h"
 #include "lwip/ip4_frag.h"
+#include "lwip/stats.h"
+#include "lwip/priv/tcp_priv.h"
 
 #include "struct.h"
 #include "util.h"
 #include "var.h"
+#include "relay_stats.h"
+#include "sys_clock.h"
+#include "timer_wheel.h"
 
 #if defined(LWIP_UNIX_LINUX)
 
@@ -29,6 +34,12 @@
 
 #include "udp_raw.h"
 #include "tcp_raw.h"
+#include "syn_guard.h"
+#include "socks_pool.h"
+#include "upstream.h"
+#include "zerocopy.h"
+#include "sock_tune.h"
+#include "mux.h"
 
 /* lwip host IP configuration */
 struct netif netif;
@@ -60,6 +71,12 @@ void sigterm_cb(struct ev_loop *loop, ev_signal *watcher, int revents);
 
 void sigint_cb(struct ev_loop *loop, ev_signal *watcher, int revents);
 
+void sigusr1_cb(struct ev_loop *loop, ev_signal *watcher, int revents);
+
+void lwip_timer_cb(struct ev_loop *loop, ev_timer *watcher, int revents);
+
+void clock_cb(struct ev_loop *loop, ev_check *watcher, int revents);
+
 void sigusr2_cb(struct ev_loop *loop, ev_signal *watcher, int revents);
 
 static void
@@ -170,6 +187,20 @@ void parse_config(int argc, char **argv) {
                         datap = &conf->socks_server;
                     } else if (strcmp(tk, "socks_port") == 0) {
                         datap = &conf->socks_port;
+                    } else if (strcmp(tk, "socks_servers") == 0) {
+                        datap = &conf->socks_servers;
+                    } else if (strcmp(tk, "socks_balance") == 0) {
+                        datap = &conf->socks_balance;
+                    } else if (strcmp(tk, "socks_affinity") == 0) {
+                        datap = &conf->socks_affinity;
+                    } else if (strcmp(tk, "socks_health_interval") == 0) {
+                        datap = &conf->socks_health_interval;
+                    } else if (strcmp(tk, "socks_health_fails") == 0) {
+                        datap = &conf->socks_health_fails;
+                    } else if (strcmp(tk, "socks_health_rises") == 0) {
+                        datap = &conf->socks_health_rises;
+                    } else if (strcmp(tk, "socks_health_target") == 0) {
+                        datap = &conf->socks_health_target;
                     } else if (strcmp(tk, "remote_dns_server") == 0) {
                         datap = &conf->remote_dns_server;
                     } else if (strcmp(tk, "remote_dns_port") == 0) {
@@ -190,6 +221,56 @@ void parse_config(int argc, char **argv) {
                         datap = &conf->after_start_shell;
                     } else if (strcmp(tk, "before_shutdown_shell") == 0) {
                         datap = &conf->before_shutdown_shell;
+                    } else if (strcmp(tk, "syn_backlog") == 0) {
+                        datap = &conf->syn_backlog;
+                    } else if (strcmp(tk, "syn_rate_per_source") == 0) {
+                        datap = &conf->syn_rate_per_source;
+                    } else if (strcmp(tk, "syn_burst_per_source") == 0) {
+                        datap = &conf->syn_burst_per_source;
+                    } else if (strcmp(tk, "max_connections") == 0) {
+                        datap = &conf->max_connections;
+                    } else if (strcmp(tk, "relay_evict_min_idle") == 0) {
+                        datap = &conf->relay_evict_min_idle;
+                    } else if (strcmp(tk, "relay_buffer_size") == 0) {
+                        datap = &conf->relay_buffer_size;
+                    } else if (strcmp(tk, "relay_buffer_max_bytes") == 0) {
+                        datap = &conf->relay_buffer_max_bytes;
+                    } else if (strcmp(tk, "relay_idle_timeout") == 0) {
+                        datap = &conf->relay_idle_timeout;
+                    } else if (strcmp(tk, "zerocopy_threshold") == 0) {
+                        datap = &conf->zerocopy_threshold;
+                    } else if (strcmp(tk, "ooseq_max_bytes_per_conn") == 0) {
+                        datap = &conf->ooseq_max_bytes_per_conn;
+                    } else if (strcmp(tk, "ooseq_max_pbufs_per_conn") == 0) {
+                        datap = &conf->ooseq_max_pbufs_per_conn;
+                    } else if (strcmp(tk, "ooseq_max_bytes") == 0) {
+                        datap = &conf->ooseq_max_bytes;
+                    } else if (strcmp(tk, "ooseq_max_pbufs") == 0) {
+                        datap = &conf->ooseq_max_pbufs;
+                    } else if (strcmp(tk, "socks_connect_timeout") == 0) {
+                        datap = &conf->socks_connect_timeout;
+                    } else if (strcmp(tk, "socks_handshake_timeout") == 0) {
+                        datap = &conf->socks_handshake_timeout;
+                    } else if (strcmp(tk, "socks_pipeline") == 0) {
+                        datap = &conf->socks_pipeline;
+                    } else if (strcmp(tk, "socks_fastopen") == 0) {
+                        datap = &conf->socks_fastopen;
+                    } else if (strcmp(tk, "socks_hedge_delay") == 0) {
+                        datap = &conf->socks_hedge_delay;
+                    } else if (strcmp(tk, "mux_server") == 0) {
+                        datap = &conf->mux_server;
+                    } else if (strcmp(tk, "mux_connections") == 0) {
+                        datap = &conf->mux_connections;
+                    } else if (strcmp(tk, "socks_autotune") == 0) {
+                        datap = &conf->socks_autotune;
+                    } else if (strcmp(tk, "socks_autotune_interval") == 0) {
+                        datap = &conf->socks_autotune_interval;
+                    } else if (strcmp(tk, "socks_buffer_max") == 0) {
+                        datap = &conf->socks_buffer_max;
+                    } else if (strcmp(tk, "socks_pool_size") == 0) {
+                        datap = &conf->socks_pool_size;
+                    } else if (strcmp(tk, "socks_pool_idle_ttl") == 0) {
+                        datap = &conf->socks_pool_idle_ttl;
                     } else {
                         printf("Unrecognised key: %s\n", tk);
                     }
@@ -281,6 +362,7 @@ void parse_config(int argc, char **argv) {
 int
 main(int argc, char **argv) {
     parse_config(argc, argv);
+    sys_clock_update();
     /* lwip/src/core/init.c */
     lwip_init();
 
@@ -299,8 +381,15 @@ main(int argc, char **argv) {
     netif_create_ip6_linklocal_address(&netif, 1);
 #endif
 
+    timer_wheel_init();
+    upstream_init();
+    zerocopy_init();
+    sock_tune_init();
     udp_raw_init();
     tcp_raw_init();
+    socks_pool_init();
+    mux_init();
+    syn_guard_init(&netif);
 
     struct ev_io *tuntap_io = (struct ev_io *) mem_malloc(sizeof(struct ev_io));
     if (tuntap_io == NULL) {
@@ -325,6 +414,11 @@ main(int argc, char **argv) {
     ev_signal_init(&signal_int_watcher, sigint_cb, SIGINT);
     ev_signal_start(loop, &signal_int_watcher);
 
+    // eg: kill -USR1, dump stats
+    ev_signal signal_usr1_watcher;
+    ev_signal_init(&signal_usr1_watcher, sigusr1_cb, SIGUSR1);
+    ev_signal_start(loop, &signal_usr1_watcher);
+
     ev_signal signal_usr2_watcher;
     ev_signal_init(&signal_usr2_watcher, sigusr2_cb, SIGUSR2);
     ev_signal_start(loop, &signal_usr2_watcher);
@@ -336,8 +430,20 @@ main(int argc, char **argv) {
     ev_io_start(loop, tuntap_io);
 
 
-    // TODO
-    sys_check_timeouts();
+    /**
+     * refresh the cached clock right after polling, before any other watcher
+     */
+    ev_check clock_watcher;
+    ev_check_init(&clock_watcher, clock_cb);
+    ev_set_priority(&clock_watcher, EV_MAXPRI);
+    ev_check_start(loop, &clock_watcher);
+
+    /**
+     * lwip timers: retransmission, keepalive, and expiry of half open pcbs
+     */
+    ev_timer lwip_timer_watcher;
+    ev_timer_init(&lwip_timer_watcher, lwip_timer_cb, 0., TCP_TMR_INTERVAL / 1000.);
+    ev_timer_start(loop, &lwip_timer_watcher);
 
     /**
      * setup shell scripts
@@ -404,11 +510,27 @@ void sigint_cb(struct ev_loop *loop, ev_signal *watcher, int revents) {
     exit(0); // kill all threads
 }
 
+void sigusr1_cb(struct ev_loop *loop, ev_signal *watcher, int revents) {
+    printf("SIGUSR1 handler called in process, dump stats\n");
+    stats_display();
+    relay_stats_display();
+    tcp_raw_display();
+}
+
 void sigusr2_cb(struct ev_loop *loop, ev_signal *watcher, int revents) {
     printf("SIGUSR2 handler called in process!!! TODO reload config.\n");
 }
 
+void clock_cb(struct ev_loop *loop, ev_check *watcher, int revents) {
+    sys_clock_update();
+}
+
+void lwip_timer_cb(struct ev_loop *loop, ev_timer *watcher, int revents) {
+    sys_check_timeouts();
+}
+
 void tuntap_read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    relay_stats.packets_in++;
     if (strcmp(conf->ip_mode, "tun") == 0) {
         tunif_input(&netif);
     } else {
@@ -0,0 +1,563 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unordered_map>
+#include <vector>
+
+#include "ev.h"
+
+#include "socket_util.h"
+#include "struct.h"
+#include "util.h"
+#include "var.h"
+#include "relay_stats.h"
+#include "object_pool.h"
+#include "timer_wheel.h"
+#include "socks5.h"
+#include "mux.h"
+
+#ifndef MSG_NOSIGNAL
+/* SO_NOSIGPIPE, see socks5_sockset */
+#define MSG_NOSIGNAL 0
+#endif
+
+/* data frames queued to one session, the rest waits in the relays' upq */
+#define MUX_SEND_BUFFER (1024 * 1024)
+/* one whole frame fits, several per recv */
+#define MUX_RECV_BUFFER (2 * (MUX_HEADER_SIZE + MUX_FRAME_MAX))
+/* credit goes back in UPDs of at least this much */
+#define MUX_UPD_MIN (MUX_WINDOW / 4)
+#define MUX_CONNECT_TIMEOUT 5000
+
+enum mux_session_states {
+    MS_CLOSED = 0,
+    MS_CONNECTING,
+    MS_OPEN
+};
+
+struct mux_stream {
+    struct mux_session *s;
+    u32_t sid;
+    /* PSH payload we may still send, and the peer may still send us */
+    u32_t send_credit;
+    u32_t recv_credit;
+    /* passed on by the relay, not yet handed back with UPD */
+    u32_t unreturned;
+    /* mux_stream_send took less than offered, sent is due */
+    u8_t blocked;
+    u8_t fin_sent;
+    u8_t fin_received;
+    void *arg;
+    mux_recv_fn recv;
+    mux_sent_fn sent;
+    mux_err_fn err;
+};
+
+typedef struct mux_session {
+    ev_io io;
+    ev_io wio;
+    /* connect deadline while connecting, reconnect backoff while closed */
+    timer_wheel_node retry;
+    int fd;
+    u8_t state;
+    u32_t fail_streak;
+    u32_t next_sid;
+    std::unordered_map<u32_t, mux_stream *> streams;
+    u32_t blocked;
+    /* frames read and not yet handled */
+    unsigned char *rbuf;
+    size_t rlen;
+    /* frames to write, from woff to wlen */
+    unsigned char *wbuf;
+    size_t woff;
+    size_t wlen;
+    size_t wcap;
+} mux_session;
+
+static char *server_host;
+static char *server_port;
+static mux_session *sessions;
+static int session_count;
+static ev_prepare flush_watcher;
+
+static object_pool<mux_stream> stream_pool("mux_stream");
+
+static void mux_session_connect(mux_session *s);
+
+static void mux_retry_cb(timer_wheel_node *node);
+
+static size_t
+mux_queued(const mux_session *s) {
+    return s->wlen - s->woff;
+}
+
+/**
+ * room for n more bytes at the end of the write buffer. Data frames stay
+ * within MUX_SEND_BUFFER, UPD, FIN and RST never wait and grow it.
+ */
+static unsigned char *
+mux_reserve(mux_session *s, size_t n) {
+    if (s->woff > 0 && s->wlen + n > s->wcap) {
+        memmove(s->wbuf, s->wbuf + s->woff, mux_queued(s));
+        s->wlen -= s->woff;
+        s->woff = 0;
+    }
+    if (s->wlen + n > s->wcap) {
+        size_t cap = s->wcap > 0 ? s->wcap : 65536;
+        while (cap < s->wlen + n) {
+            cap *= 2;
+        }
+        unsigned char *buf = (unsigned char *) realloc(s->wbuf, cap);
+        if (buf == NULL) {
+            return NULL;
+        }
+        s->wbuf = buf;
+        s->wcap = cap;
+    }
+    unsigned char *p = s->wbuf + s->wlen;
+    s->wlen += n;
+    return p;
+}
+
+static void
+mux_control(mux_session *s, u8_t cmd, u32_t sid, const unsigned char *payload, u16_t len) {
+    unsigned char *p = mux_reserve(s, MUX_HEADER_SIZE + len);
+    if (p == NULL) {
+        printf("mux: out of memory for a control frame\n");
+        return;
+    }
+    mux_header_put(p, cmd, len, sid);
+    if (len > 0) {
+        memcpy(p + MUX_HEADER_SIZE, payload, len);
+    }
+}
+
+/**
+ * take ms off its session, its memory goes back to the pool
+ */
+static void
+mux_stream_free(mux_stream *ms) {
+    mux_session *s = ms->s;
+    if (s != NULL) {
+        s->streams.erase(ms->sid);
+        if (ms->blocked) {
+            s->blocked--;
+        }
+    }
+    relay_stats.mux_streams--;
+    stream_pool.release(ms);
+}
+
+static void
+mux_session_fail(mux_session *s, const char *why) {
+    printf("mux session to %s:%s failed: %s\n", server_host, server_port, why);
+    ev_io_stop(EV_DEFAULT, &s->io);
+    ev_io_stop(EV_DEFAULT, &s->wio);
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    s->fd = -1;
+    if (s->state == MS_OPEN) {
+        relay_stats.mux_sessions--;
+    }
+    s->state = MS_CLOSED;
+    s->rlen = 0;
+    s->woff = 0;
+    s->wlen = 0;
+    s->blocked = 0;
+    relay_stats.mux_session_failures++;
+
+    /* every stream goes down with it, as if reset */
+    std::unordered_map<u32_t, mux_stream *> streams;
+    streams.swap(s->streams);
+    for (auto &it : streams) {
+        mux_stream *ms = it.second;
+        ms->s = NULL;
+        relay_stats.mux_streams_reset++;
+        ms->err(ms->arg);
+        mux_stream_free(ms);
+    }
+
+    s->fail_streak++;
+    timer_wheel_arm(&s->retry, LWIP_MIN(s->fail_streak, 30) * 1000, mux_retry_cb);
+}
+
+/**
+ * streams that ran out of room may go on, those with credit are called back
+ */
+static void
+mux_wake(mux_session *s) {
+    std::vector<u32_t> ready;
+    for (auto &it : s->streams) {
+        if (it.second->blocked && it.second->send_credit > 0) {
+            ready.push_back(it.first);
+        }
+    }
+    for (size_t i = 0; i < ready.size() && mux_queued(s) < MUX_SEND_BUFFER; i++) {
+        /* looked up again, a callback may have closed it */
+        auto it = s->streams.find(ready[i]);
+        if (it == s->streams.end() || !it->second->blocked) {
+            continue;
+        }
+        mux_stream *ms = it->second;
+        ms->blocked = 0;
+        s->blocked--;
+        ms->sent(ms->arg);
+    }
+}
+
+/**
+ * write what is queued, and what woken streams queue in turn, until the
+ * socket is full
+ */
+static void
+mux_session_flush(mux_session *s) {
+    while (mux_queued(s) > 0) {
+        ssize_t n = send(s->fd, s->wbuf + s->woff, mux_queued(s), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                ev_io_start(EV_DEFAULT, &s->wio);
+                return;
+            }
+            mux_session_fail(s, strerror(errno));
+            return;
+        }
+        relay_stats.mux_writes++;
+        s->woff += n;
+        if (s->woff == s->wlen) {
+            s->woff = 0;
+            s->wlen = 0;
+        }
+        if (s->blocked > 0) {
+            mux_wake(s);
+        }
+    }
+    ev_io_stop(EV_DEFAULT, &s->wio);
+}
+
+/**
+ * one write per session and loop iteration, however many relays queued frames
+ */
+static void
+mux_flush_cb(struct ev_loop *loop, ev_prepare *watcher, int revents) {
+    for (int i = 0; i < session_count; i++) {
+        mux_session *s = &sessions[i];
+        if (s->state == MS_OPEN && mux_queued(s) > 0 && !ev_is_active(&s->wio)) {
+            mux_session_flush(s);
+        }
+    }
+}
+
+static void
+mux_frame(mux_session *s, const mux_header *h, const unsigned char *payload) {
+    auto it = s->streams.find(h->sid);
+    mux_stream *ms = it != s->streams.end() ? it->second : NULL;
+
+    if (ms == NULL) {
+        if (h->cmd == MUX_PSH) {
+            /* closed on our side, stop the peer */
+            mux_control(s, MUX_RST, h->sid, NULL, 0);
+        }
+        return;
+    }
+    switch (h->cmd) {
+        case MUX_PSH:
+            if (h->length > ms->recv_credit) {
+                printf("mux: stream %u sent past its credit, reset\n", ms->sid);
+                mux_control(s, MUX_RST, ms->sid, NULL, 0);
+                relay_stats.mux_streams_reset++;
+                ms->err(ms->arg);
+                mux_stream_free(ms);
+                return;
+            }
+            ms->recv_credit -= h->length;
+            relay_stats.mux_bytes_down += h->length;
+            ms->recv(ms->arg, (const char *) payload, h->length);
+            break;
+        case MUX_FIN:
+            ms->fin_received = 1;
+            ms->recv(ms->arg, NULL, 0);
+            break;
+        case MUX_UPD:
+            if (h->length == 4) {
+                ms->send_credit += mux_get32(payload);
+                if (ms->blocked && mux_queued(s) < MUX_SEND_BUFFER) {
+                    ms->blocked = 0;
+                    s->blocked--;
+                    ms->sent(ms->arg);
+                }
+            }
+            break;
+        case MUX_RST:
+            relay_stats.mux_streams_reset++;
+            ms->err(ms->arg);
+            mux_stream_free(ms);
+            break;
+        default:
+            /* NOP, or a SYN we never expect from the server */
+            break;
+    }
+}
+
+static void
+mux_read_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
+    mux_session *s = container_of(watcher, mux_session, io);
+
+    ssize_t n = recv(s->fd, s->rbuf + s->rlen, MUX_RECV_BUFFER - s->rlen, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (n <= 0) {
+        mux_session_fail(s, n == 0 ? "closed by the server" : strerror(errno));
+        return;
+    }
+    s->rlen += n;
+
+    size_t off = 0;
+    while (s->rlen - off >= MUX_HEADER_SIZE) {
+        mux_header h;
+        mux_header_get(s->rbuf + off, &h);
+        if (h.ver != MUX_VERSION) {
+            mux_session_fail(s, "bad frame version");
+            return;
+        }
+        if (s->rlen - off < MUX_HEADER_SIZE + (size_t) h.length) {
+            break;
+        }
+        mux_frame(s, &h, s->rbuf + off + MUX_HEADER_SIZE);
+        off += MUX_HEADER_SIZE + h.length;
+    }
+    memmove(s->rbuf, s->rbuf + off, s->rlen - off);
+    s->rlen -= off;
+}
+
+static void
+mux_write_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
+    mux_session *s = container_of(watcher, mux_session, wio);
+
+    if (s->state == MS_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+            mux_session_fail(s, strerror(error != 0 ? error : errno));
+            return;
+        }
+        printf("mux session to %s:%s up\n", server_host, server_port);
+        timer_wheel_cancel(&s->retry);
+        s->state = MS_OPEN;
+        s->fail_streak = 0;
+        relay_stats.mux_sessions++;
+        ev_io_start(EV_DEFAULT, &s->io);
+    }
+    mux_session_flush(s);
+}
+
+static void
+mux_retry_cb(timer_wheel_node *node) {
+    mux_session *s = container_of(node, mux_session, retry);
+
+    if (s->state == MS_CONNECTING) {
+        mux_session_fail(s, "connect timed out");
+    } else if (s->state == MS_CLOSED) {
+        mux_session_connect(s);
+    }
+}
+
+static void
+mux_session_connect(mux_session *s) {
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(server_host);
+    addr.sin_port = htons(atoi(server_port));
+
+    s->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (s->fd < 0) {
+        mux_session_fail(s, strerror(errno));
+        return;
+    }
+    setnonblocking(s->fd);
+    socks5_sockset(s->fd);
+    if (connect(s->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        mux_session_fail(s, strerror(errno));
+        return;
+    }
+    s->state = MS_CONNECTING;
+    ev_io_init(&s->io, mux_read_cb, s->fd, EV_READ);
+    ev_io_init(&s->wio, mux_write_cb, s->fd, EV_WRITE);
+    ev_io_start(EV_DEFAULT, &s->wio);
+    timer_wheel_arm(&s->retry, MUX_CONNECT_TIMEOUT, mux_retry_cb);
+}
+
+void
+mux_init(void) {
+    if (conf->mux_server == NULL) {
+        return;
+    }
+    char *colon = strrchr(conf->mux_server, ':');
+    if (colon == NULL) {
+        printf("mux_server: %s has no port, mux off\n", conf->mux_server);
+        return;
+    }
+    server_host = strndup(conf->mux_server, colon - conf->mux_server);
+    server_port = strdup(colon + 1);
+    session_count = LWIP_MAX(conf_int(conf->mux_connections, 2), 1);
+
+    sessions = new mux_session[session_count]();
+    for (int i = 0; i < session_count; i++) {
+        mux_session *s = &sessions[i];
+        s->fd = -1;
+        s->next_sid = 1;
+        s->rbuf = (unsigned char *) malloc(MUX_RECV_BUFFER);
+        mux_session_connect(s);
+    }
+
+    ev_prepare_init(&flush_watcher, mux_flush_cb);
+    ev_prepare_start(EV_DEFAULT, &flush_watcher);
+}
+
+mux_stream *
+mux_stream_open(u32_t ip, u16_t port, void *arg, mux_recv_fn recv, mux_sent_fn sent, mux_err_fn err) {
+    mux_session *s = NULL;
+
+    if (session_count == 0) {
+        return NULL;
+    }
+    for (int i = 0; i < session_count; i++) {
+        mux_session *c = &sessions[i];
+        if (c->state == MS_OPEN && (s == NULL || c->streams.size() < s->streams.size())) {
+            s = c;
+        }
+    }
+    if (s == NULL) {
+        relay_stats.mux_fallbacks++;
+        return NULL;
+    }
+    mux_stream *ms = stream_pool.alloc();
+    if (ms == NULL) {
+        return NULL;
+    }
+    ms->s = s;
+    ms->sid = s->next_sid;
+    s->next_sid += 2;
+    ms->send_credit = MUX_WINDOW;
+    ms->recv_credit = MUX_WINDOW;
+    ms->arg = arg;
+    ms->recv = recv;
+    ms->sent = sent;
+    ms->err = err;
+
+    /* the target as a socks 5 address, the server connects to it */
+    unsigned char addr[7];
+    addr[0] = SOSKC5_ADDRTYPE_IPV4;
+    memcpy(addr + 1, &ip, 4);
+    addr[5] = (unsigned char) (port >> 8);
+    addr[6] = (unsigned char) port;
+    mux_control(s, MUX_SYN, ms->sid, addr, sizeof(addr));
+
+    s->streams[ms->sid] = ms;
+    relay_stats.mux_streams++;
+    relay_stats.mux_streams_opened++;
+    return ms;
+}
+
+size_t
+mux_stream_send(mux_stream *ms, const struct iovec *iov, int iovcnt) {
+    mux_session *s = ms->s;
+    size_t want = 0;
+    size_t taken = 0;
+    int i = 0;
+    size_t off = 0;
+
+    for (int k = 0; k < iovcnt; k++) {
+        want += iov[k].iov_len;
+    }
+    while (taken < want) {
+        size_t room = mux_queued(s) + MUX_HEADER_SIZE < MUX_SEND_BUFFER ?
+                      MUX_SEND_BUFFER - mux_queued(s) - MUX_HEADER_SIZE : 0;
+        size_t n = LWIP_MIN(LWIP_MIN(want - taken, (size_t) MUX_FRAME_MAX), LWIP_MIN((size_t) ms->send_credit, room));
+        if (n == 0) {
+            break;
+        }
+        unsigned char *p = mux_reserve(s, MUX_HEADER_SIZE + n);
+        if (p == NULL) {
+            break;
+        }
+        mux_header_put(p, MUX_PSH, (uint16_t) n, ms->sid);
+        p += MUX_HEADER_SIZE;
+        for (size_t left = n; left > 0;) {
+            size_t c = LWIP_MIN(iov[i].iov_len - off, left);
+            memcpy(p, (const char *) iov[i].iov_base + off, c);
+            p += c;
+            left -= c;
+            off += c;
+            if (off == iov[i].iov_len) {
+                i++;
+                off = 0;
+            }
+        }
+        ms->send_credit -= n;
+        taken += n;
+    }
+    relay_stats.mux_bytes_up += taken;
+
+    if (taken < want && !ms->blocked) {
+        ms->blocked = 1;
+        s->blocked++;
+        if (ms->send_credit == 0) {
+            relay_stats.mux_credit_stalls++;
+        } else {
+            relay_stats.mux_buffer_stalls++;
+        }
+    }
+    return taken;
+}
+
+void
+mux_stream_consumed(mux_stream *ms, u32_t len) {
+    ms->unreturned += len;
+    if (ms->unreturned >= MUX_UPD_MIN) {
+        unsigned char credit[4];
+        mux_put32(credit, ms->unreturned);
+        mux_control(ms->s, MUX_UPD, ms->sid, credit, sizeof(credit));
+        ms->recv_credit += ms->unreturned;
+        ms->unreturned = 0;
+    }
+}
+
+void
+mux_stream_shutdown(mux_stream *ms) {
+    if (!ms->fin_sent) {
+        ms->fin_sent = 1;
+        mux_control(ms->s, MUX_FIN, ms->sid, NULL, 0);
+    }
+}
+
+void
+mux_stream_close(mux_stream *ms) {
+    if (!ms->fin_sent || !ms->fin_received) {
+        /* not finished both ways, the server drops its end too */
+        mux_control(ms->s, MUX_RST, ms->sid, NULL, 0);
+    }
+    mux_stream_free(ms);
+}
+
+void
+mux_display(void) {
+    if (session_count == 0) {
+        return;
+    }
+    printf("\nMUX SESSIONS to %s:%s\n", server_host, server_port);
+    for (int i = 0; i < session_count; i++) {
+        mux_session *s = &sessions[i];
+        printf("\t%d: %s, streams %zu, queued %zu bytes, stalled streams %u\n", i,
+               s->state == MS_OPEN ? "up" : s->state == MS_CONNECTING ? "connecting" : "down",
+               s->streams.size(), mux_queued(s), s->blocked);
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef IP2SOCKS_MUX_H
+#define IP2SOCKS_MUX_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "lwip/arch.h"
+#include "mux_frame.h"
+
+typedef struct mux_stream mux_stream;
+
+/**
+ * PSH payload of a stream, always taken whole: the peer stays within the
+ * credit handed back with mux_stream_consumed. NULL and 0 for its FIN.
+ */
+typedef void (*mux_recv_fn)(void *arg, const char *buf, size_t len);
+
+/**
+ * mux_stream_send took less than it was offered and there is credit or
+ * room in the session again
+ */
+typedef void (*mux_sent_fn)(void *arg);
+
+/**
+ * the peer reset the stream or its session died, it is freed once this returns
+ */
+typedef void (*mux_err_fn)(void *arg);
+
+/**
+ * With mux_server set, tcp relays are carried as streams over
+ * mux_connections long lived connections to it, instead of one socks
+ * connection each. mux_server runs ip2socks-demux, see src/tools. Relays
+ * fall back to socks while no connection is up.
+ */
+void mux_init(void);
+
+/**
+ * open a stream to ip (network order) port (host order) on the least loaded session
+ *
+ * @return NULL when mux is off or no session is up
+ */
+mux_stream *mux_stream_open(u32_t ip, u16_t port, void *arg, mux_recv_fn recv, mux_sent_fn sent, mux_err_fn err);
+
+/**
+ * queue up to the stream's credit and the session's buffer room of iov
+ *
+ * @return the bytes taken, sent is called once more can go when that is less than offered
+ */
+size_t mux_stream_send(mux_stream *ms, const struct iovec *iov, int iovcnt);
+
+/**
+ * the relay passed on len received bytes, the peer may send that much more
+ */
+void mux_stream_consumed(mux_stream *ms, u32_t len);
+
+/**
+ * send FIN, no more data from us, the peer's still arrives
+ */
+void mux_stream_shutdown(mux_stream *ms);
+
+/**
+ * forget the stream, with RST unless both sides sent FIN. Anything the
+ * peer still sends is answered with RST.
+ */
+void mux_stream_close(mux_stream *ms);
+
+void mux_display(void);
+
+#endif //IP2SOCKS_MUX_H
@@ -0,0 +1,66 @@
+#ifndef IP2SOCKS_MUX_FRAME_H
+#define IP2SOCKS_MUX_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Framing of the multiplexed transport between ip2socks and ip2socks-demux,
+ * after smux. Every frame is an 8 byte header, big endian,
+ *
+ *   ver(1) cmd(1) length(2) stream id(4)
+ *
+ * followed by length bytes of payload. Streams are opened by ip2socks, with
+ * odd ids. Either side may send MUX_WINDOW bytes of PSH payload on a stream
+ * before the other returns credit with UPD, so a stream whose reader is slow
+ * never holds up the others sharing its connection.
+ */
+#define MUX_VERSION 1
+#define MUX_HEADER_SIZE 8
+#define MUX_FRAME_MAX 65535
+/* initial credit of a stream, in each direction */
+#define MUX_WINDOW 262144
+
+enum mux_cmds {
+    MUX_SYN = 0, /* open, payload is a socks 5 address: atype, address, port */
+    MUX_FIN,     /* the sender has no more data for this stream */
+    MUX_PSH,     /* data */
+    MUX_NOP,     /* keepalive, no payload */
+    MUX_UPD,     /* 4 byte payload, credit handed back to the sender */
+    MUX_RST      /* the stream is gone, e.g. the target refused the connection */
+};
+
+typedef struct mux_header {
+    uint8_t ver;
+    uint8_t cmd;
+    uint16_t length;
+    uint32_t sid;
+} mux_header;
+
+static inline void mux_put32(unsigned char *buf, uint32_t v) {
+    buf[0] = (unsigned char) (v >> 24);
+    buf[1] = (unsigned char) (v >> 16);
+    buf[2] = (unsigned char) (v >> 8);
+    buf[3] = (unsigned char) v;
+}
+
+static inline uint32_t mux_get32(const unsigned char *buf) {
+    return ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) | ((uint32_t) buf[2] << 8) | buf[3];
+}
+
+static inline void mux_header_put(unsigned char *buf, uint8_t cmd, uint16_t length, uint32_t sid) {
+    buf[0] = MUX_VERSION;
+    buf[1] = cmd;
+    buf[2] = (unsigned char) (length >> 8);
+    buf[3] = (unsigned char) length;
+    mux_put32(buf + 4, sid);
+}
+
+static inline void mux_header_get(const unsigned char *buf, mux_header *h) {
+    h->ver = buf[0];
+    h->cmd = buf[1];
+    h->length = (uint16_t) ((buf[2] << 8) | buf[3]);
+    h->sid = mux_get32(buf + 4);
+}
+
+#endif //IP2SOCKS_MUX_FRAME_H
@@ -7,6 +7,8 @@ extern "C" {
 
 int setnonblocking(int fd);
 
+int setblocking(int fd);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,22 @@
+#include <stdio.h>
+
+#include "object_pool.h"
+
+/* every pool, in construction order */
+static object_pool_base *pools;
+static object_pool_base **pools_tail = &pools;
+
+object_pool_base::object_pool_base(const char *name, size_t object_size)
+        : name(name), object_size(object_size), live(0), peak(0), allocated(0), slabs(0), next(NULL) {
+    *pools_tail = this;
+    pools_tail = &next;
+}
+
+void
+object_pool_display(void) {
+    printf("\nOBJECT POOLS\n");
+    for (object_pool_base *p = pools; p != NULL; p = p->next) {
+        printf("\t%s: live %u, peak %u, allocated %u (%u slabs, %lu bytes)\n", p->name, p->live, p->peak,
+               p->allocated, p->slabs, (unsigned long) (p->allocated * p->object_size));
+    }
+}
@@ -0,0 +1,102 @@
+#ifndef IP2SOCKS_OBJECT_POOL_H
+#define IP2SOCKS_OBJECT_POOL_H
+
+#include <stdlib.h>
+#include <new>
+
+#include "lwip/arch.h"
+
+#define OBJECT_POOL_ALIGN 64
+
+/**
+ * counters and registration shared by all object_pool types, every pool is
+ * listed by object_pool_display
+ */
+class object_pool_base {
+public:
+    const char *name;
+    size_t object_size;
+    /* handed out and not yet released */
+    u32_t live;
+    u32_t peak;
+    /* objects in slabs, live or on the freelist */
+    u32_t allocated;
+    u32_t slabs;
+
+    object_pool_base(const char *name, size_t object_size);
+
+    object_pool_base *next;
+};
+
+void object_pool_display(void);
+
+/**
+ * Typed freelist allocator for relay state. Objects are carved out of slabs
+ * of SLAB slots, each slot padded to a cache line so two relays never share
+ * one. Released slots go back to the freelist, slabs are never returned to
+ * malloc: the pool stays at the peak number of connections.
+ *
+ * alloc value-initializes (zeroes a plain struct, runs the constructor
+ * otherwise), release runs the destructor.
+ */
+template<typename T, u32_t SLAB = 64>
+class object_pool : public object_pool_base {
+public:
+    explicit object_pool(const char *name) : object_pool_base(name, sizeof(slot)), free_list(NULL) {
+    }
+
+    /**
+     * @return NULL when a new slab cannot be allocated
+     */
+    T *alloc() {
+        if (free_list == NULL && grow() < 0) {
+            return NULL;
+        }
+        slot *s = free_list;
+        free_list = s->next;
+        if (++live > peak) {
+            peak = live;
+        }
+        return new(s->storage) T();
+    }
+
+    void release(T *obj) {
+        if (obj == NULL) {
+            return;
+        }
+        obj->~T();
+        slot *s = reinterpret_cast<slot *>(obj);
+        s->next = free_list;
+        free_list = s;
+        live--;
+    }
+
+private:
+    struct alignas(OBJECT_POOL_ALIGN) slot {
+        union {
+            slot *next;
+            unsigned char storage[sizeof(T)];
+        };
+    };
+
+    static_assert(alignof(T) <= OBJECT_POOL_ALIGN, "object_pool: T needs a larger alignment");
+
+    slot *free_list;
+
+    int grow() {
+        void *mem;
+        if (posix_memalign(&mem, OBJECT_POOL_ALIGN, SLAB * sizeof(slot)) != 0) {
+            return -1;
+        }
+        slot *slab = static_cast<slot *>(mem);
+        for (u32_t i = 0; i < SLAB; i++) {
+            slab[i].next = free_list;
+            free_list = &slab[i];
+        }
+        allocated += SLAB;
+        slabs++;
+        return 0;
+    }
+};
+
+#endif //IP2SOCKS_OBJECT_POOL_H
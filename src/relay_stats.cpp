@@ -0,0 +1,167 @@
+#include <stdio.h>
+
+#include "relay_stats.h"
+#include "object_pool.h"
+#include "upstream.h"
+#include "mux.h"
+#include "sys_clock.h"
+
+struct relay_stats relay_stats;
+
+/* previous dump, for rates between two dumps */
+static uint32_t last_dump_ms;
+static uint64_t last_upload_bytes;
+
+static double
+ratio(uint64_t num, uint64_t den) {
+    return den == 0 ? 0. : (double) num / (double) den;
+}
+
+void
+relay_stats_display(void) {
+    /*
+     * sys_now used to be one gettimeofday per call: calls per packet is the
+     * clock syscall rate without the cache, reads per packet the rate with it
+     */
+    printf("\nCLOCK\n");
+    printf("\tpackets in: %llu\n", (unsigned long long) relay_stats.packets_in);
+    printf("\tsys_now calls: %llu\n", sys_clock_calls);
+    printf("\tclock reads: %llu\n", sys_clock_reads);
+    printf("\tsys_now calls per packet: %.2f\n", ratio(sys_clock_calls, relay_stats.packets_in));
+    printf("\tclock reads per packet: %.2f\n", ratio(sys_clock_reads, relay_stats.packets_in));
+
+    printf("\nRELAY TCP OUTPUT\n");
+    printf("\tflushes: %llu\n", (unsigned long long) relay_stats.flushes);
+    printf("\tpcbs flushed: %llu\n", (unsigned long long) relay_stats.flushed_pcbs);
+    printf("\tsegments: %llu\n", (unsigned long long) relay_stats.flushed_segments);
+    printf("\tbytes: %llu\n", (unsigned long long) relay_stats.flushed_bytes);
+    printf("\tsegments per flush: %.2f\n", ratio(relay_stats.flushed_segments, relay_stats.flushes));
+    printf("\tavg segment size: %.1f\n", ratio(relay_stats.flushed_bytes, relay_stats.flushed_segments));
+
+    printf("\nRELAY TCP SYN\n");
+    printf("\tseen: %llu\n", (unsigned long long) relay_stats.syn_seen);
+    printf("\tadmitted: %llu\n", (unsigned long long) relay_stats.syn_admitted);
+    printf("\tdropped (source rate): %llu\n", (unsigned long long) relay_stats.syn_dropped_rate);
+    printf("\tdropped (backlog full): %llu\n", (unsigned long long) relay_stats.syn_dropped_backlog);
+    printf("\tdropped (no capacity): %llu\n", (unsigned long long) relay_stats.syn_dropped_capacity);
+
+    printf("\nRELAY TCP CONNECTIONS\n");
+    printf("\tcapacity: %llu\n", (unsigned long long) relay_stats.relay_capacity);
+    printf("\tlive: %llu\n", (unsigned long long) relay_stats.relay_live);
+    printf("\tpeak: %llu\n", (unsigned long long) relay_stats.relay_peak);
+    printf("\tevicted (idle lru): %llu\n", (unsigned long long) relay_stats.relay_evicted);
+    printf("\thalf closed by the client: %llu\n", (unsigned long long) relay_stats.relay_half_closed_up);
+    printf("\thalf closed by the server: %llu\n", (unsigned long long) relay_stats.relay_half_closed_down);
+    printf("\trefused: %llu\n", (unsigned long long) relay_stats.relay_refused);
+    printf("\tupstream write blocked: %llu\n", (unsigned long long) relay_stats.upstream_write_blocked);
+
+    printf("\nRELAY UDP\n");
+    printf("\tdropped (no pbuf): %llu\n", (unsigned long long) relay_stats.udp_dropped_nomem);
+
+    /*
+     * upload benchmark: push bulk data through the tunnel (iperf -c, scp)
+     * and send SIGUSR1 twice, the rate is measured between the two dumps
+     */
+    uint32_t now = sys_clock_now();
+    printf("\nRELAY TCP UPLOAD\n");
+    printf("\tbytes: %llu\n", (unsigned long long) relay_stats.upload_bytes);
+    printf("\tsendmsg calls: %llu\n", (unsigned long long) relay_stats.upload_sendmsg);
+    printf("\tbytes per sendmsg: %.1f\n", ratio(relay_stats.upload_bytes, relay_stats.upload_sendmsg));
+    printf("\tpbufs per sendmsg: %.2f\n", ratio(relay_stats.upload_iovecs, relay_stats.upload_sendmsg));
+    if (last_dump_ms != 0 && now != last_dump_ms) {
+        printf("\tMB/s since last dump: %.2f\n",
+               ratio(relay_stats.upload_bytes - last_upload_bytes, now - last_dump_ms) * 1000. / (1024. * 1024.));
+    }
+    last_dump_ms = now;
+    last_upload_bytes = relay_stats.upload_bytes;
+    printf("\tzero copy sends: %llu\n", (unsigned long long) relay_stats.zerocopy_sends);
+    printf("\tzero copy bytes: %llu\n", (unsigned long long) relay_stats.zerocopy_bytes);
+    printf("\tzero copy completions: %llu\n", (unsigned long long) relay_stats.zerocopy_completions);
+    printf("\tzero copy completions copied by the kernel: %llu\n", (unsigned long long) relay_stats.zerocopy_copied);
+    printf("\tzero copy fallbacks to copy: %llu\n", (unsigned long long) relay_stats.zerocopy_fallbacks);
+
+    printf("\nRELAY TCP DOWNLOAD\n");
+    printf("\tbytes: %llu\n", (unsigned long long) relay_stats.download_bytes);
+    printf("\tblocks allocated: %llu\n", (unsigned long long) relay_stats.download_blocks);
+    printf("\tclosed pcbs holding blocks: %llu\n", (unsigned long long) relay_stats.download_lingering);
+    printf("\treads paused (sndbuf full): %llu\n", (unsigned long long) relay_stats.download_read_paused);
+
+    printf("\nRELAY TCP BUFFERS\n");
+    if (relay_stats.buffer_budget > 0) {
+        printf("\tbytes: %llu of %llu (%.1f%%)\n", (unsigned long long) relay_stats.buffer_bytes,
+               (unsigned long long) relay_stats.buffer_budget,
+               ratio(relay_stats.buffer_bytes, relay_stats.buffer_budget) * 100.);
+    } else {
+        printf("\tbytes: %llu, no limit\n", (unsigned long long) relay_stats.buffer_bytes);
+    }
+    printf("\tpeak bytes: %llu\n", (unsigned long long) relay_stats.buffer_peak);
+    printf("\treads paused (budget): %llu\n", (unsigned long long) relay_stats.buffer_budget_paused);
+    printf("\trelays refused (budget): %llu\n", (unsigned long long) relay_stats.relay_refused_budget);
+
+    printf("\nRELAY TCP OOSEQ\n");
+    printf("\tbytes: %llu\n", (unsigned long long) relay_stats.ooseq_bytes);
+    printf("\tpbufs: %llu\n", (unsigned long long) relay_stats.ooseq_pbufs);
+    printf("\tpeak bytes: %llu\n", (unsigned long long) relay_stats.ooseq_peak_bytes);
+    printf("\ttrimmed (per connection limit): %llu\n", (unsigned long long) relay_stats.ooseq_trimmed);
+    printf("\tdiscarded (global limit, oldest first): %llu\n", (unsigned long long) relay_stats.ooseq_discarded);
+
+    printf("\nSOCKS HANDSHAKE\n");
+    printf("\tpipelined: %llu\n", (unsigned long long) relay_stats.socks_pipelined);
+    printf("\tfallbacks: %llu\n", (unsigned long long) relay_stats.socks_pipeline_fallbacks);
+    printf("\tfirst payload bytes: %llu\n", (unsigned long long) relay_stats.socks_early_bytes);
+    printf("\tfast open, data in SYN: %llu\n", (unsigned long long) relay_stats.socks_tfo_syn_data);
+    printf("\tfast open, accepted by the server: %llu\n", (unsigned long long) relay_stats.socks_tfo_accepted);
+    printf("\tfast open, refused (data sent again): %llu\n", (unsigned long long) relay_stats.socks_tfo_refused);
+    printf("\tfast open, no cookie yet: %llu\n", (unsigned long long) relay_stats.socks_tfo_cookie_miss);
+    printf("\thedged: %llu\n", (unsigned long long) relay_stats.socks_hedges);
+    printf("\thedge won: %llu\n", (unsigned long long) relay_stats.socks_hedge_won);
+    printf("\thedge lost: %llu\n", (unsigned long long) relay_stats.socks_hedge_lost);
+    printf("\thedge won after the first failed: %llu\n", (unsigned long long) relay_stats.socks_hedge_rescued);
+    printf("\tnot hedged, first payload already sent: %llu\n", (unsigned long long) relay_stats.socks_hedge_skipped);
+    printf("\thedge saved (estimated): %llu ms over %llu races, %.1f ms each\n",
+           (unsigned long long) relay_stats.socks_hedge_saved_ms, (unsigned long long) relay_stats.socks_hedge_measured,
+           relay_stats.socks_hedge_measured > 0 ?
+           (double) relay_stats.socks_hedge_saved_ms / relay_stats.socks_hedge_measured : 0.);
+
+    printf("\nSOCKS AUTOTUNE\n");
+    printf("\tTCP_INFO samples: %llu\n", (unsigned long long) relay_stats.tune_samples);
+    printf("\tmean rtt: %.2f ms\n", ratio(relay_stats.tune_rtt_us_sum, relay_stats.tune_samples) / 1000.);
+    printf("\tSO_SNDBUF grown: %llu\n", (unsigned long long) relay_stats.tune_sndbuf_resized);
+    printf("\tSO_RCVBUF grown: %llu\n", (unsigned long long) relay_stats.tune_rcvbuf_resized);
+    printf("\tTCP_NODELAY on (interactive): %llu\n", (unsigned long long) relay_stats.tune_nodelay_on);
+    printf("\tTCP_NODELAY off (bulk): %llu\n", (unsigned long long) relay_stats.tune_nodelay_off);
+
+    printf("\nSOCKS POOL\n");
+    printf("\tidle: %llu\n", (unsigned long long) relay_stats.pool_idle);
+    printf("\thits: %llu\n", (unsigned long long) relay_stats.pool_hits);
+    printf("\tmisses: %llu\n", (unsigned long long) relay_stats.pool_misses);
+    printf("\tdead (closed by server): %llu\n", (unsigned long long) relay_stats.pool_dead);
+    printf("\texpired (idle ttl): %llu\n", (unsigned long long) relay_stats.pool_expired);
+    printf("\tfill failed: %llu\n", (unsigned long long) relay_stats.pool_fill_failed);
+
+    printf("\nTIMER WHEEL\n");
+    printf("\tarmed: %llu\n", (unsigned long long) relay_stats.timers_armed);
+    printf("\tfired: %llu\n", (unsigned long long) relay_stats.timers_fired);
+
+    printf("\nSOCKS HEALTH\n");
+    printf("\tejected: %llu\n", (unsigned long long) relay_stats.upstream_ejected);
+    printf("\treinstated: %llu\n", (unsigned long long) relay_stats.upstream_reinstated);
+    printf("\tplaced with all servers down: %llu\n", (unsigned long long) relay_stats.upstream_all_down);
+
+    printf("\nMUX\n");
+    printf("\tsessions up: %llu\n", (unsigned long long) relay_stats.mux_sessions);
+    printf("\tsession failures: %llu\n", (unsigned long long) relay_stats.mux_session_failures);
+    printf("\tstreams: %llu (opened %llu, reset %llu)\n", (unsigned long long) relay_stats.mux_streams,
+           (unsigned long long) relay_stats.mux_streams_opened, (unsigned long long) relay_stats.mux_streams_reset);
+    printf("\tfell back to socks, no session up: %llu\n", (unsigned long long) relay_stats.mux_fallbacks);
+    printf("\tbytes up: %llu, down: %llu\n", (unsigned long long) relay_stats.mux_bytes_up,
+           (unsigned long long) relay_stats.mux_bytes_down);
+    printf("\tstalls, out of credit: %llu, session buffer full: %llu\n",
+           (unsigned long long) relay_stats.mux_credit_stalls, (unsigned long long) relay_stats.mux_buffer_stalls);
+    printf("\twrites: %llu\n", (unsigned long long) relay_stats.mux_writes);
+
+    upstream_display();
+    mux_display();
+
+    object_pool_display();
+}
@@ -0,0 +1,135 @@
+#ifndef IP2SOCKS_RELAY_STATS_H
+#define IP2SOCKS_RELAY_STATS_H
+
+#include <stdint.h>
+
+/**
+ * relay counters, dumped next to lwip_stats on SIGUSR1
+ */
+struct relay_stats {
+    /* packets read from the tun/tap device */
+    uint64_t packets_in;
+
+    /* deferred tcp_output, see tcp_raw_flush_cb */
+    uint64_t flushes;
+    uint64_t flushed_pcbs;
+    uint64_t flushed_segments;
+    uint64_t flushed_bytes;
+
+    /* SYNs to the catch-all listener, see syn_guard_input */
+    uint64_t syn_seen;
+    uint64_t syn_admitted;
+    uint64_t syn_dropped_rate;
+    uint64_t syn_dropped_backlog;
+    uint64_t syn_dropped_capacity;
+
+    /* tcp relays, see tcp_raw_admit */
+    uint64_t relay_capacity;
+    uint64_t relay_live;
+    uint64_t relay_peak;
+    uint64_t relay_evicted;
+    /* one direction closed while the other still relays */
+    uint64_t relay_half_closed_up;
+    uint64_t relay_half_closed_down;
+    uint64_t relay_refused;
+    /* sends to the socks server that found its socket buffer full */
+    uint64_t upstream_write_blocked;
+
+    /* udp answers lost for lack of a pbuf to return them in */
+    uint64_t udp_dropped_nomem;
+
+    /* client to socks server, sent straight from the received pbufs */
+    uint64_t upload_bytes;
+    uint64_t upload_sendmsg;
+    uint64_t upload_iovecs;
+    /* MSG_ZEROCOPY sends of the above, see zerocopy_sendmsg */
+    uint64_t zerocopy_sends;
+    uint64_t zerocopy_bytes;
+    uint64_t zerocopy_completions;
+    uint64_t zerocopy_copied;
+    uint64_t zerocopy_fallbacks;
+
+    /* socks server to client, tcp_write straight from recv blocks */
+    uint64_t download_bytes;
+    uint64_t download_blocks;
+    uint64_t download_lingering;
+    uint64_t download_read_paused;
+
+    /* relay blocks and upq of all relays, see relay_buffer_max_bytes */
+    uint64_t buffer_bytes;
+    uint64_t buffer_peak;
+    uint64_t buffer_budget;
+    uint64_t buffer_budget_paused;
+    uint64_t relay_refused_budget;
+
+    /* out of sequence queues, see tcp_ooseq_cb */
+    uint64_t ooseq_bytes;
+    uint64_t ooseq_pbufs;
+    uint64_t ooseq_peak_bytes;
+    uint64_t ooseq_trimmed;
+    uint64_t ooseq_discarded;
+
+    /* pipelined socks handshakes, see socks5_handshake_fail */
+    uint64_t socks_pipelined;
+    uint64_t socks_pipeline_fallbacks;
+    uint64_t socks_early_bytes;
+    /* tcp fast open to the socks server */
+    uint64_t socks_tfo_syn_data;
+    uint64_t socks_tfo_accepted;
+    uint64_t socks_tfo_refused;
+    uint64_t socks_tfo_cookie_miss;
+    /* second handshakes raced against slow ones, see tcp_raw_hedge_cb */
+    uint64_t socks_hedges;
+    uint64_t socks_hedge_won;
+    uint64_t socks_hedge_lost;
+    uint64_t socks_hedge_rescued;
+    uint64_t socks_hedge_skipped;
+    /* races won while the primary still ran, and an estimate of the time saved:
+       the primary server's mean handshake time minus the primary's elapsed time */
+    uint64_t socks_hedge_measured;
+    uint64_t socks_hedge_saved_ms;
+
+    /* TCP_INFO driven tuning of sockets to the socks server, see sock_tune_init */
+    uint64_t tune_samples;
+    uint64_t tune_rtt_us_sum;
+    uint64_t tune_sndbuf_resized;
+    uint64_t tune_rcvbuf_resized;
+    uint64_t tune_nodelay_on;
+    uint64_t tune_nodelay_off;
+
+    /* socks servers ejected and reinstated by health checks, see upstream_init */
+    uint64_t upstream_ejected;
+    uint64_t upstream_reinstated;
+    uint64_t upstream_all_down;
+
+    /* streams carried over connections to mux_server, see mux_init */
+    uint64_t mux_sessions;
+    uint64_t mux_session_failures;
+    uint64_t mux_streams;
+    uint64_t mux_streams_opened;
+    uint64_t mux_streams_reset;
+    uint64_t mux_fallbacks;
+    uint64_t mux_bytes_up;
+    uint64_t mux_bytes_down;
+    uint64_t mux_credit_stalls;
+    uint64_t mux_buffer_stalls;
+    uint64_t mux_writes;
+
+    /* greeted sockets to the socks server, see socks_pool_take */
+    uint64_t pool_idle;
+    uint64_t pool_hits;
+    uint64_t pool_misses;
+    uint64_t pool_dead;
+    uint64_t pool_expired;
+    uint64_t pool_fill_failed;
+
+    /* relay deadlines, see timer_wheel_arm */
+    uint64_t timers_armed;
+    uint64_t timers_fired;
+};
+
+extern struct relay_stats relay_stats;
+
+void relay_stats_display(void);
+
+#endif //IP2SOCKS_RELAY_STATS_H
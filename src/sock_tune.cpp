@@ -0,0 +1,177 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+/* the BSD TCP_MSS from netinet/tcp.h, lwipopts.h defines lwip's */
+#undef TCP_MSS
+
+#include "struct.h"
+#include "util.h"
+#include "var.h"
+#include "relay_stats.h"
+#include "sys_clock.h"
+#include "sock_tune.h"
+
+/* smallest buffer set, below it the kernel's defaults do better */
+#define SOCK_TUNE_BUFFER_MIN 65536
+
+static int enabled;
+static u32_t interval;
+static u32_t buffer_max;
+
+#if defined(__linux__) && defined(TCP_INFO)
+#define SOCK_TUNE_SUPPORTED 1
+
+/* struct tcp_info of linux 4.9, glibc's stops at tcpi_total_retrans */
+struct sock_tune_info {
+    struct tcp_info base;
+    uint64_t pacing_rate;
+    uint64_t max_pacing_rate;
+    uint64_t bytes_acked;    /* linux 4.1 */
+    uint64_t bytes_received; /* linux 4.1 */
+    uint32_t segs_out;
+    uint32_t segs_in;
+    uint32_t notsent_bytes;
+    uint32_t min_rtt;
+    uint32_t data_segs_in;
+    uint32_t data_segs_out;
+    uint64_t delivery_rate;  /* linux 4.9 */
+};
+
+static_assert(offsetof(struct sock_tune_info, pacing_rate) == 104, "sock_tune_info: unexpected struct tcp_info");
+
+/* the kernel fills as much as it knows */
+#define SOCK_TUNE_HAS(len, field) ((len) >= offsetof(struct sock_tune_info, field) + sizeof(((struct sock_tune_info *) 0)->field))
+#endif
+
+void
+sock_tune_init(void) {
+    enabled = conf->socks_autotune != NULL && strcmp(conf->socks_autotune, "true") == 0;
+    interval = (u32_t) conf_int(conf->socks_autotune_interval, 1000);
+    buffer_max = (u32_t) conf_int(conf->socks_buffer_max, 4194304);
+#ifndef SOCK_TUNE_SUPPORTED
+    if (enabled) {
+        printf("socks_autotune: TCP_INFO is not supported on this system\n");
+        enabled = 0;
+    }
+#endif
+}
+
+#ifdef SOCK_TUNE_SUPPORTED
+/**
+ * Grow the opt buffer of fd to twice the bandwidth-delay product of rate.
+ * Buffers only grow, a flow keeps what its busiest interval needed.
+ *
+ * @return 1 if it was resized
+ */
+static int
+sock_tune_buffer(int fd, int opt, u32_t *cur, uint64_t rate, u32_t rtt_us) {
+    uint64_t want = 2 * rate * rtt_us / 1000000;
+
+    if (want < SOCK_TUNE_BUFFER_MIN) {
+        want = SOCK_TUNE_BUFFER_MIN;
+    }
+    if (want > buffer_max) {
+        want = buffer_max;
+    }
+    if (*cur != 0) {
+        /* a quarter more at least, not a setsockopt per sample */
+        if (want <= *cur + *cur / 4) {
+            return 0;
+        }
+    } else {
+        /* setting it ends the kernel's autotuning, leave it while it is enough */
+        int actual = 0;
+        socklen_t len = sizeof(actual);
+        if (getsockopt(fd, SOL_SOCKET, opt, &actual, &len) == 0 && (uint64_t) actual >= want) {
+            return 0;
+        }
+    }
+    int val = (int) want;
+    if (setsockopt(fd, SOL_SOCKET, opt, &val, sizeof(val)) < 0) {
+        return 0;
+    }
+    *cur = (u32_t) want;
+    return 1;
+}
+
+static void
+sock_tune_sample_cb(timer_wheel_node *node) {
+    sock_tune *st = container_of(node, sock_tune, sample);
+    struct sock_tune_info info;
+    socklen_t len = sizeof(info);
+    u32_t now = sys_clock_now();
+    u32_t elapsed = now - st->sampled_at;
+
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(st->fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        printf("getsockopt TCP_INFO failed: %s\n", strerror(errno));
+        return;
+    }
+    relay_stats.tune_samples++;
+    st->rtt_us = info.base.tcpi_rtt;
+    st->cwnd = info.base.tcpi_snd_cwnd;
+    st->mss = info.base.tcpi_snd_mss;
+    relay_stats.tune_rtt_us_sum += st->rtt_us;
+
+    if (SOCK_TUNE_HAS(len, bytes_received) && elapsed > 0) {
+        st->tx_rate = (info.bytes_acked - st->bytes_acked) * 1000 / elapsed;
+        st->rx_rate = (info.bytes_received - st->bytes_received) * 1000 / elapsed;
+        st->bytes_acked = info.bytes_acked;
+        st->bytes_received = info.bytes_received;
+    } else if (st->rtt_us > 0) {
+        /* a window per round trip */
+        st->tx_rate = (uint64_t) st->cwnd * st->mss * 1000000 / st->rtt_us;
+    }
+    if (SOCK_TUNE_HAS(len, delivery_rate) && info.delivery_rate > st->tx_rate) {
+        /* not app limited, what the path delivered when there was data */
+        st->tx_rate = info.delivery_rate;
+    }
+    st->sampled_at = now;
+
+    if (st->rtt_us > 0) {
+        u32_t rcv_rtt = info.base.tcpi_rcv_rtt > 0 ? info.base.tcpi_rcv_rtt : st->rtt_us;
+        relay_stats.tune_sndbuf_resized += sock_tune_buffer(st->fd, SO_SNDBUF, &st->sndbuf, st->tx_rate, st->rtt_us);
+        relay_stats.tune_rcvbuf_resized += sock_tune_buffer(st->fd, SO_RCVBUF, &st->rcvbuf, st->rx_rate, rcv_rtt);
+    }
+
+    if (st->writes > 0 && st->mss > 0) {
+        /* keystrokes and requests, not bulk: Nagle would hold them for an ack */
+        u8_t interactive = st->write_bytes / st->writes < st->mss;
+        if (interactive != st->nodelay) {
+            int val = interactive;
+            if (setsockopt(st->fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val)) == 0) {
+                st->nodelay = interactive;
+                if (interactive) {
+                    relay_stats.tune_nodelay_on++;
+                } else {
+                    relay_stats.tune_nodelay_off++;
+                }
+            }
+        }
+    }
+    st->writes = 0;
+    st->write_bytes = 0;
+
+    timer_wheel_arm(&st->sample, interval, sock_tune_sample_cb);
+}
+#endif
+
+void
+sock_tune_start(sock_tune *st, int fd) {
+#ifdef SOCK_TUNE_SUPPORTED
+    if (!enabled) {
+        return;
+    }
+    st->fd = fd;
+    st->sampled_at = sys_clock_now();
+    timer_wheel_arm(&st->sample, interval, sock_tune_sample_cb);
+#endif
+}
+
+void
+sock_tune_stop(sock_tune *st) {
+    timer_wheel_cancel(&st->sample);
+}
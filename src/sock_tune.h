@@ -0,0 +1,52 @@
+#ifndef IP2SOCKS_SOCK_TUNE_H
+#define IP2SOCKS_SOCK_TUNE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lwip/arch.h"
+#include "timer_wheel.h"
+
+/**
+ * per socket autotuning state, zeroed memory is a socket that is not tuned
+ */
+typedef struct sock_tune {
+    timer_wheel_node sample;
+    int fd;
+    /* last TCP_INFO sample */
+    u32_t rtt_us;
+    u32_t cwnd;
+    u32_t mss;
+    /* bytes per second */
+    uint64_t tx_rate;
+    uint64_t rx_rate;
+    uint64_t bytes_acked;
+    uint64_t bytes_received;
+    u32_t sampled_at;
+    /* what was set, 0 while the kernel's autotuning owns the buffer */
+    u32_t sndbuf;
+    u32_t rcvbuf;
+    u8_t nodelay;
+    /* sends since the last sample, see sock_tune_wrote */
+    u32_t writes;
+    u32_t write_bytes;
+} sock_tune;
+
+/**
+ * Samples TCP_INFO of every socket to the socks server each
+ * socks_autotune_interval ms, sizes SO_SNDBUF and SO_RCVBUF to twice the
+ * measured bandwidth-delay product in each direction and turns Nagle off
+ * while a flow only sends less than a segment at a time.
+ */
+void sock_tune_init(void);
+
+void sock_tune_start(sock_tune *st, int fd);
+
+void sock_tune_stop(sock_tune *st);
+
+static inline void sock_tune_wrote(sock_tune *st, size_t len) {
+    st->writes++;
+    st->write_bytes += len;
+}
+
+#endif //IP2SOCKS_SOCK_TUNE_H
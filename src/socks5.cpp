@@ -1,6 +1,31 @@
 #include <fcntl.h>
+#include <netinet/tcp.h>
+/* the BSD TCP_MSS from netinet/tcp.h, lwipopts.h defines lwip's */
+#undef TCP_MSS
+#include "socket_util.h"
+#include "struct.h"
+#include "util.h"
+#include "relay_stats.h"
+#include "sys_clock.h"
 #include "socks5.h"
 
+/* per stage handshake timeouts */
+static u32_t connect_timeout = 2000;
+static u32_t reply_timeout = 2000;
+
+/* pipelined handshakes, off after SOCKS5_PIPELINE_MAX_FAILURES fallbacks in a row */
+#define SOCKS5_PIPELINE_MAX_FAILURES 3
+static int pipeline = 0;
+static int pipeline_failures = 0;
+
+#if defined(__linux__) && !defined(TCP_FASTOPEN_CONNECT)
+/* linux 4.11, older libc headers */
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+
+/* tcp fast open to the socks server, off for good if the kernel refuses it */
+static int fastopen = 0;
+
 int32_t socks5_sockset(int sockfd) {
     struct timeval tmo = {0};
     int opt = 1;
@@ -47,7 +72,12 @@ int socks5_connect(const char *proxy_host, const char *proxy_port) {
     return socks_fd;
 }
 
-int socks5_auth(int sockfd, const char *server_host, const char *server_port, u_char cmd, int atype) {
+/**
+ * socks 5 method negotiation, no authentication
+ *
+ * @return -1 on error
+ */
+int socks5_greet(int sockfd) {
     char buff[BUFFER_SIZE];
     /**
      * socks 5 method request start
@@ -70,61 +100,34 @@ int socks5_auth(int sockfd, const char *server_host, const char *server_port, u_
     /**
      * socks 5 method request end
      */
+    return 0;
+}
+
+int socks5_auth(int sockfd, const char *server_host, const char *server_port, u_char cmd, int atype) {
+    if (socks5_greet(sockfd) < 0) {
+        return -1;
+    }
+    return socks5_request(sockfd, server_host, server_port, cmd, atype);
+}
+
+/**
+ * send a socks 5 request on a greeted socket and check its reply
+ *
+ * @return -1 on error, -2 when the server refused the request (REP not 0)
+ */
+int socks5_request(int sockfd, const char *server_host, const char *server_port, u_char cmd, int atype) {
+    char buff[BUFFER_SIZE];
 
     /**
      * socks 5 request start
      */
-    if (atype == 1) {
-        unsigned char socksreq[600];
-        int idx;
-
-        idx = 0;
-        socksreq[idx++] = 5; /* version */
-        socksreq[idx++] = cmd;
-        socksreq[idx++] = 0;
-        socksreq[idx++] = 1; /* ATYP: IPv4 = 1 */
-
-        struct sockaddr_in *saddr_in = (struct sockaddr_in *) malloc(sizeof(struct sockaddr_in));;
-        saddr_in->sin_family = AF_INET;
-        inet_aton(server_host, &(saddr_in->sin_addr));
-        for (int i = 0; i < 4; i++) {
-            socksreq[idx++] = ((unsigned char *) &saddr_in->sin_addr.s_addr)[i];
-        }
-
-        int p = atoi(server_port);
-        socksreq[idx++] = (unsigned char) ((p >> 8) & 0xff); /* PORT MSB */
-        socksreq[idx++] = (unsigned char) (p & 0xff);        /* PORT LSB */
-
-        send(sockfd, (char *) socksreq, idx, 0);
-        free(saddr_in);
-    } else if (atype == 3) {
-        char *buffer, *temp;
-        u_char v = 0x05, rsv = 0x00, atyp = 0x03;
-
-        const char host_len = (char) strlen(server_host);
-        uint16_t port = htons(atoi(server_port));
-        buffer = static_cast<char *>(malloc(strlen(server_host) + 7));
-        temp = buffer;
-        /* Assemble the request packet */
-        (void) memcpy(temp, &v, sizeof(v));
-        temp += sizeof(v);
-        (void) memcpy(temp, &cmd, sizeof(cmd));
-        temp += sizeof(cmd);
-        (void) memcpy(temp, &rsv, sizeof(rsv));
-        temp += sizeof(rsv);
-        (void) memcpy(temp, &atyp, sizeof(atyp));
-        temp += sizeof(atyp);
-        (void) memcpy(temp, &host_len, sizeof(host_len));
-        temp += sizeof(host_len);
-        (void) memcpy(temp, server_host, strlen(server_host));
-        temp += strlen(server_host);
-        (void) memcpy(temp, &port, sizeof(&port));
-        temp += sizeof(&port);
-        send(sockfd, buffer, temp - buffer, 0);
-        free(buffer);
-    } else if (atype == 4) {
-        // ipv6 TODO
+    u_char socksreq[SOCKS5_MSG_MAX];
+    size_t idx = socks5_build_request(socksreq, server_host, server_port, cmd, atype);
+    if (idx == 0) {
+        printf("socks5 request build error\n");
+        return -1;
     }
+    send(sockfd, (char *) socksreq, idx, 0);
     /**
      * socks 5 request end
      */
@@ -141,6 +144,514 @@ int socks5_auth(int sockfd, const char *server_host, const char *server_port, u_
         printf("socks 5 response version error\n");
         return -1;
     }
+    if (0x00 != ((socks5_response_t *) buff)->cmd) {
+        printf("socks 5 response error, rep %d\n", ((socks5_response_t *) buff)->cmd);
+        return -2;
+    }
+
+    return 0;
+}
+
+/**
+ * Assemble a socks 5 request for server_host:server_port into buf.
+ *
+ * @return the request length, 0 if the address type is not supported
+ */
+size_t socks5_build_request(u_char *buf, const char *server_host, const char *server_port, u_char cmd, int atype) {
+    size_t idx = 0;
+    int p = atoi(server_port);
+
+    buf[idx++] = SOCKS5_VERSION;
+    buf[idx++] = cmd;
+    buf[idx++] = 0; /* RSV */
+
+    if (atype == 1) {
+        struct in_addr addr;
+        buf[idx++] = SOSKC5_ADDRTYPE_IPV4;
+        inet_aton(server_host, &addr);
+        memcpy(buf + idx, &addr.s_addr, 4);
+        idx += 4;
+    } else if (atype == 3) {
+        size_t host_len = strlen(server_host);
+        if (host_len > 255) {
+            return 0;
+        }
+        buf[idx++] = SOSKC5_ADDRTYPE_DOMAIN;
+        buf[idx++] = (u_char) host_len;
+        memcpy(buf + idx, server_host, host_len);
+        idx += host_len;
+    } else {
+        // ipv6 TODO
+        return 0;
+    }
+
+    buf[idx++] = (u_char) ((p >> 8) & 0xff); /* PORT MSB */
+    buf[idx++] = (u_char) (p & 0xff);        /* PORT LSB */
+    return idx;
+}
+
+/**
+ * @return the full length of the socks 5 reply starting in buf, 0 while
+ * not enough of it has been read to tell
+ */
+size_t socks5_reply_len(const u_char *buf, size_t len) {
+    if (len < 5) {
+        return 0;
+    }
+    switch (buf[3]) {
+        case SOSKC5_ADDRTYPE_IPV4:
+            return 4 + 4 + 2;
+        case SOSKC5_ADDRTYPE_DOMAIN:
+            return 4 + 1 + buf[4] + 2;
+        case SOSKC5_ADDRTYPE_IPV6:
+            return 4 + 16 + 2;
+        default:
+            return 4 + 4 + 2;
+    }
+}
+
+
+/**
+ * non blocking handshake, driven by hs->io and hs->timer
+ */
+static void socks5_handshake_cb_io(struct ev_loop *loop, ev_io *watcher, int revents);
+
+static void socks5_handshake_timeout_cb(timer_wheel_node *node);
+
+/**
+ * @return 1 if greeting, request and first payload may go out in one write
+ */
+static int
+socks5_pipeline_ok(socks5_handshake *hs) {
+    return pipeline && pipeline_failures < SOCKS5_PIPELINE_MAX_FAILURES && !hs->fallback && hs->req_len > 0;
+}
+
+static void
+socks5_handshake_watch(socks5_handshake *hs, int events, u32_t timeout) {
+    ev_io_stop(EV_DEFAULT, &hs->io);
+    ev_io_set(&hs->io, hs->fd, events);
+    ev_io_start(EV_DEFAULT, &hs->io);
+
+    timer_wheel_arm(&hs->timer, timeout, socks5_handshake_timeout_cb);
+}
+
+static void
+socks5_handshake_done(socks5_handshake *hs, int ok) {
+    ev_io_stop(EV_DEFAULT, &hs->io);
+    timer_wheel_cancel(&hs->timer);
+    if (ok) {
+        hs->stage = S5_ESTABLISHED;
+        if (hs->pipelined) {
+            pipeline_failures = 0;
+            relay_stats.socks_early_bytes += hs->early_len;
+        }
+    } else {
+        hs->stage = S5_FAILED;
+        hs->early_len = 0;
+        if (hs->fd > 0) {
+            close(hs->fd);
+        }
+        hs->fd = -1;
+    }
+    hs->cb(hs, ok);
+}
+
+/**
+ * non blocking connect to hs->proxy_host, completion is seen as EV_WRITE
+ *
+ * @return -1 on error
+ */
+static int
+socks5_handshake_connect(socks5_handshake *hs) {
+    struct sockaddr_in socks_proxy_addr;
+
+    socks_proxy_addr.sin_family = AF_INET;
+    socks_proxy_addr.sin_addr.s_addr = inet_addr(hs->proxy_host);
+    socks_proxy_addr.sin_port = htons(atoi(hs->proxy_port));
+
+    if ((hs->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        printf("socket failed\n");
+        return -1;
+    }
+    setnonblocking(hs->fd);
+    socks5_sockset(hs->fd);
+    hs->tfo = S5_TFO_OFF;
+#ifdef TCP_FASTOPEN_CONNECT
+    if (fastopen) {
+        int one = 1;
+        /* connect returns at once, the SYN leaves with the first send */
+        if (setsockopt(hs->fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one)) == 0) {
+            hs->tfo = S5_TFO_ARMED;
+        } else {
+            printf("setsockopt TCP_FASTOPEN_CONNECT failed: %s, tcp fast open off\n", strerror(errno));
+            fastopen = 0;
+        }
+    }
+#endif
+    if (0 > connect(hs->fd, (struct sockaddr *) &socks_proxy_addr, sizeof(socks_proxy_addr)) &&
+        errno != EINPROGRESS) {
+        printf("connect failed\n");
+        close(hs->fd);
+        hs->fd = -1;
+        return -1;
+    }
+
+    hs->stage = S5_CONNECT;
+    ev_io_init(&hs->io, socks5_handshake_cb_io, hs->fd, EV_WRITE);
+    ev_io_start(EV_DEFAULT, &hs->io);
+    timer_wheel_arm(&hs->timer, connect_timeout, socks5_handshake_timeout_cb);
+    return 0;
+}
+
+/**
+ * The server went away or stalled. If it was sent a pipelined handshake
+ * that may be the reason: start over with one round trip per stage,
+ * without the first payload.
+ */
+static void
+socks5_handshake_fail(socks5_handshake *hs, int retry) {
+    if (retry && hs->pipelined) {
+        printf("socks5 pipelined handshake failed in stage %d, falling back\n", hs->stage);
+        relay_stats.socks_pipeline_fallbacks++;
+        if (++pipeline_failures == SOCKS5_PIPELINE_MAX_FAILURES) {
+            printf("socks5 pipelined handshake disabled\n");
+        }
+
+        ev_io_stop(EV_DEFAULT, &hs->io);
+        timer_wheel_cancel(&hs->timer);
+        if (hs->fd > 0) {
+            close(hs->fd);
+        }
+        hs->fd = -1;
+        hs->pipelined = 0;
+        hs->early_len = 0;
+        hs->fallback = 1;
+        if (socks5_handshake_connect(hs) == 0) {
+            return;
+        }
+    }
+    socks5_handshake_done(hs, 0);
+}
+
+/**
+ * write what is left of hs->out, then wait for the reply of this stage
+ *
+ * @return -1 on error
+ */
+static int
+socks5_handshake_flush(socks5_handshake *hs) {
+    while (hs->out_sent < hs->out_len) {
+        ssize_t n = send(hs->fd, hs->out + hs->out_sent, hs->out_len - hs->out_sent, 0);
+        if (n < 0) {
+            if (errno == EINPROGRESS && hs->tfo == S5_TFO_ARMED) {
+                /* no cookie for the server yet, the SYN asked for one, send once connected */
+                hs->tfo = S5_TFO_OFF;
+                relay_stats.socks_tfo_cookie_miss++;
+                socks5_handshake_watch(hs, EV_WRITE, connect_timeout);
+                return 0;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                socks5_handshake_watch(hs, EV_WRITE, reply_timeout);
+                return 0;
+            }
+            return -1;
+        }
+        if (hs->tfo == S5_TFO_ARMED) {
+            hs->tfo = S5_TFO_SYN_DATA;
+            relay_stats.socks_tfo_syn_data++;
+        }
+        hs->out_sent += n;
+    }
+    socks5_handshake_watch(hs, EV_READ, reply_timeout);
+    return 0;
+}
+
+static void
+socks5_handshake_stage(socks5_handshake *hs, u_char stage, const u_char *out, size_t out_len) {
+    hs->stage = stage;
+    memcpy(hs->out, out, out_len);
+    hs->out_len = out_len;
+    hs->out_sent = 0;
+    hs->in_len = 0;
+    if (socks5_handshake_flush(hs) < 0) {
+        printf("socks5 handshake send error [%d]\n", errno);
+        socks5_handshake_fail(hs, 1);
+    }
+}
+
+/**
+ * append the client's first payload to hs->out, it is answered by the
+ * target once the request succeeded
+ */
+static void
+socks5_handshake_append_early(socks5_handshake *hs) {
+    hs->early_len = 0;
+    if (hs->early != NULL) {
+        hs->early_len = hs->early(hs, hs->out + hs->out_len, SOCKS5_EARLY_MAX);
+        hs->out_len += hs->early_len;
+    }
+}
+
+/**
+ * read the reply of the current stage without reading past its end,
+ * anything after it belongs to the relay
+ *
+ * @return 1 once the whole reply is in hs->in, 0 to wait, -1 on error
+ */
+static int
+socks5_handshake_read(socks5_handshake *hs) {
+    for (;;) {
+        size_t want;
+        if (hs->stage == S5_METHOD) {
+            want = sizeof(socks5_method_res_t);
+        } else {
+            want = socks5_reply_len(hs->in, hs->in_len);
+            if (want == 0) {
+                want = 5;
+            }
+        }
+        if (hs->in_len >= want) {
+            return 1;
+        }
+
+        ssize_t n = recv(hs->fd, hs->in + hs->in_len, want - hs->in_len, 0);
+        if (n == 0) {
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return 0;
+            }
+            return -1;
+        }
+        hs->in_len += n;
+    }
+}
+
+/**
+ * The first reply is in, so the SYN was answered: did the server take the
+ * data it carried or did the kernel have to send it again?
+ */
+static void
+socks5_handshake_tfo_check(socks5_handshake *hs) {
+    hs->tfo = S5_TFO_OFF;
+#if defined(TCP_INFO) && defined(TCPI_OPT_SYN_DATA)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(hs->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        if (info.tcpi_options & TCPI_OPT_SYN_DATA) {
+            relay_stats.socks_tfo_accepted++;
+        } else {
+            relay_stats.socks_tfo_refused++;
+        }
+    }
+#endif
+}
+
+static void
+socks5_handshake_cb_io(struct ev_loop *loop, ev_io *watcher, int revents) {
+    socks5_handshake *hs = container_of(watcher, socks5_handshake, io);
+
+    if (hs->stage == S5_CONNECT) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(hs->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            printf("socks5 connect failed [%d]\n", err);
+            socks5_handshake_done(hs, 0);
+            return;
+        }
+        /* socks 5 method request, no authentication */
+        u_char greeting[3] = {SOCKS5_VERSION, 0x01, 0x00};
+        if (socks5_pipeline_ok(hs)) {
+            /* greeting, request and first payload in one write, both replies are read in order */
+            hs->pipelined = 1;
+            relay_stats.socks_pipelined++;
+            memcpy(hs->out, greeting, sizeof(greeting));
+            memcpy(hs->out + sizeof(greeting), hs->req, hs->req_len);
+            hs->out_len = sizeof(greeting) + hs->req_len;
+            socks5_handshake_append_early(hs);
+            hs->stage = S5_METHOD;
+            hs->out_sent = 0;
+            hs->in_len = 0;
+            if (socks5_handshake_flush(hs) < 0) {
+                printf("socks5 handshake send error [%d]\n", errno);
+                socks5_handshake_fail(hs, 1);
+            }
+            return;
+        }
+        socks5_handshake_stage(hs, S5_METHOD, greeting, sizeof(greeting));
+        return;
+    }
+
+    if (revents & EV_WRITE) {
+        if (hs->stage == S5_REQUEST && hs->out_sent == 0 && hs->pipelined && !hs->early_done) {
+            /* resumed on a pooled socket, request and first payload in one write */
+            hs->early_done = 1;
+            socks5_handshake_append_early(hs);
+        }
+        if (socks5_handshake_flush(hs) < 0) {
+            printf("socks5 handshake send error [%d]\n", errno);
+            socks5_handshake_fail(hs, 1);
+        }
+        return;
+    }
+
+    for (;;) {
+        int ret = socks5_handshake_read(hs);
+        if (ret == 0) {
+            return;
+        }
+        if (ret < 0) {
+            printf("socks5 handshake recv error [%d] in stage %d\n", errno, hs->stage);
+            socks5_handshake_fail(hs, 1);
+            return;
+        }
+
+        if (hs->tfo == S5_TFO_SYN_DATA) {
+            socks5_handshake_tfo_check(hs);
+        }
+
+        if (hs->stage == S5_METHOD) {
+            if (SOCKS5_VERSION != ((socks5_method_res_t *) hs->in)->ver || 0x00 != ((socks5_method_res_t *) hs->in)->method) {
+                printf("socks5_method_res_t error\n");
+                socks5_handshake_done(hs, 0);
+                return;
+            }
+            if (hs->req_len == 0) {
+                /* greeting only, the request is sent later with socks5_handshake_resume */
+                socks5_handshake_done(hs, 1);
+                return;
+            }
+            if (hs->pipelined) {
+                /* the request is already out, its reply follows */
+                hs->stage = S5_REQUEST;
+                hs->in_len = 0;
+                continue;
+            }
+            socks5_handshake_stage(hs, S5_REQUEST, hs->req, hs->req_len);
+            return;
+        }
+
+        if (SOCKS5_VERSION != ((socks5_response_t *) hs->in)->ver) {
+            printf("socks 5 response version error\n");
+            socks5_handshake_done(hs, 0);
+            return;
+        }
+        if (0x00 != ((socks5_response_t *) hs->in)->cmd) {
+            printf("socks 5 response error, rep %d\n", ((socks5_response_t *) hs->in)->cmd);
+            hs->rep = ((socks5_response_t *) hs->in)->cmd;
+            socks5_handshake_done(hs, 0);
+            return;
+        }
+        socks5_handshake_done(hs, 1);
+        return;
+    }
+}
+
+static void
+socks5_handshake_timeout_cb(timer_wheel_node *node) {
+    socks5_handshake *hs = container_of(node, socks5_handshake, timer);
+    printf("socks5 handshake timeout in stage %d\n", hs->stage);
+    socks5_handshake_fail(hs, hs->stage != S5_CONNECT);
+}
+
+void socks5_handshake_init(void) {
+    connect_timeout = (u32_t) conf_int(conf->socks_connect_timeout, 2000);
+    reply_timeout = (u32_t) conf_int(conf->socks_handshake_timeout, 2000);
+    pipeline = conf->socks_pipeline != NULL && strcmp(conf->socks_pipeline, "true") == 0;
+    fastopen = conf->socks_fastopen != NULL && strcmp(conf->socks_fastopen, "true") == 0;
+#ifndef TCP_FASTOPEN_CONNECT
+    if (fastopen) {
+        printf("socks_fastopen: not supported on this system\n");
+        fastopen = 0;
+    }
+#endif
+}
+
+/**
+ * Start connecting to the socks server and negotiate cmd to
+ * server_host:server_port without blocking. cb runs from the event loop,
+ * never from inside this call. With a NULL server_host the handshake ends
+ * after the method exchange, see socks_pool.
+ *
+ * early, when not NULL, is asked for the client's first payload if the
+ * handshake is pipelined. On success hs->early_len bytes of it have been
+ * sent to the target.
+ *
+ * @return -1 if the connection could not even be started
+ */
+int socks5_handshake_start(socks5_handshake *hs, const char *proxy_host, const char *proxy_port,
+                           const char *server_host, const char *server_port, u_char cmd, int atype,
+                           socks5_handshake_cb cb, socks5_early_cb early, void *data) {
+    memset(hs, 0, sizeof(socks5_handshake));
+    hs->started = sys_clock_now();
+    hs->fd = -1;
+    hs->cb = cb;
+    hs->early = early;
+    hs->data = data;
+    hs->proxy_host = proxy_host;
+    hs->proxy_port = proxy_port;
+    if (server_host != NULL) {
+        hs->req_len = socks5_build_request(hs->req, server_host, server_port, cmd, atype);
+        if (hs->req_len == 0) {
+            return -1;
+        }
+    }
+
+    return socks5_handshake_connect(hs);
+}
+
+/**
+ * Send the request for server_host:server_port on fd, which already went
+ * through the method exchange. Like socks5_handshake_start, cb runs from
+ * the event loop, and a failure the pipelined first payload may have
+ * caused starts over on a new connection to proxy_host.
+ *
+ * @return -1 if the request could not be built, fd is left open
+ */
+int socks5_handshake_resume(socks5_handshake *hs, int fd, const char *proxy_host, const char *proxy_port,
+                            const char *server_host, const char *server_port, u_char cmd, int atype,
+                            socks5_handshake_cb cb, socks5_early_cb early, void *data) {
+    memset(hs, 0, sizeof(socks5_handshake));
+    hs->started = sys_clock_now();
+    hs->fd = -1;
+    hs->cb = cb;
+    hs->early = early;
+    hs->data = data;
+    hs->proxy_host = proxy_host;
+    hs->proxy_port = proxy_port;
+    hs->req_len = socks5_build_request(hs->req, server_host, server_port, cmd, atype);
+    if (hs->req_len == 0) {
+        return -1;
+    }
 
+    hs->fd = fd;
+    hs->stage = S5_REQUEST;
+    memcpy(hs->out, hs->req, hs->req_len);
+    hs->out_len = hs->req_len;
+    if (socks5_pipeline_ok(hs)) {
+        hs->pipelined = 1;
+        relay_stats.socks_pipelined++;
+    }
+    /* written from socks5_handshake_cb_io once the socket is writable */
+    ev_io_init(&hs->io, socks5_handshake_cb_io, hs->fd, EV_WRITE);
+    ev_io_start(EV_DEFAULT, &hs->io);
+    timer_wheel_arm(&hs->timer, reply_timeout, socks5_handshake_timeout_cb);
     return 0;
 }
+
+/**
+ * stop a handshake that is still running and close its socket
+ */
+void socks5_handshake_abort(socks5_handshake *hs) {
+    if (hs->stage >= S5_ESTABLISHED) {
+        return;
+    }
+    ev_io_stop(EV_DEFAULT, &hs->io);
+    timer_wheel_cancel(&hs->timer);
+    if (hs->fd > 0) {
+        close(hs->fd);
+    }
+    hs->fd = -1;
+    hs->stage = S5_FAILED;
+}
@@ -11,6 +11,9 @@
 #include <errno.h>
 #include <arpa/inet.h>
 
+#include "ev.h"
+#include "timer_wheel.h"
+
 #include "var.h"
 
 typedef struct {
@@ -32,11 +35,104 @@ typedef struct {
 } socks5_request_t;
 typedef socks5_request_t socks5_response_t;
 
+/* largest CONNECT/UDP ASSOCIATE request or reply: ATYP domain with 255 bytes */
+#define SOCKS5_MSG_MAX 262
+
+/* client payload sent along with a pipelined request, about one segment */
+#define SOCKS5_EARLY_MAX 1460
+
+enum socks5_tfo {
+    S5_TFO_OFF = 0,
+    S5_TFO_ARMED,   /* the first write goes out with the SYN */
+    S5_TFO_SYN_DATA /* it did, the server may still drop it */
+};
+
+enum socks5_stages {
+    S5_CONNECT = 0, /* non blocking connect() in progress */
+    S5_METHOD,      /* greeting sent, waiting for the method reply */
+    S5_REQUEST,     /* request sent, waiting for its reply */
+    S5_ESTABLISHED,
+    S5_FAILED
+};
+
+struct socks5_handshake;
+
+/**
+ * Called once when the handshake ends. On success hs->fd is connected and
+ * owned by the caller, on failure it has been closed. A failure with
+ * hs->rep set is the target refused by a working server, not the server
+ * failing.
+ */
+typedef void (*socks5_handshake_cb)(struct socks5_handshake *hs, int ok);
+
+/**
+ * Copies up to max bytes of the client's first payload into buf, without
+ * consuming them.
+ *
+ * @return the number of bytes copied
+ */
+typedef size_t (*socks5_early_cb)(struct socks5_handshake *hs, u_char *buf, size_t max);
+
+typedef struct socks5_handshake {
+    ev_io io;
+    timer_wheel_node timer;
+    int fd;
+    u_char stage;
+    /* sys_clock_now when the handshake began, for upstream_latency */
+    u32_t started;
+    const char *proxy_host;
+    const char *proxy_port;
+    /* greeting, request and first payload went out in one write */
+    u_char pipelined;
+    /* pipelining failed, this is the retry with one round trip per stage */
+    u_char fallback;
+    u_char early_done;
+    /* REP of a well formed reply that refused the request, 0 otherwise */
+    u_char rep;
+    /* tcp fast open state of the socket, see socks5_handshake_connect */
+    u_char tfo;
+    /* bytes to write in the current stage */
+    u_char out[3 + SOCKS5_MSG_MAX + SOCKS5_EARLY_MAX];
+    size_t out_len;
+    size_t out_sent;
+    /* reply bytes read in the current stage */
+    u_char in[SOCKS5_MSG_MAX];
+    size_t in_len;
+    /* request, written once the method reply arrived, empty to stop there */
+    u_char req[SOCKS5_MSG_MAX];
+    size_t req_len;
+    socks5_handshake_cb cb;
+    socks5_early_cb early;
+    /* first payload bytes sent with the request */
+    size_t early_len;
+    void *data;
+} socks5_handshake;
+
 int32_t socks5_sockset(int sockfd);
 
 int socks5_connect(const char *proxy_host, const char *proxy_port);
 
+int socks5_greet(int sockfd);
+
+int socks5_request(int sockfd, const char *server_host, const char *server_port, u_char cmd, int atype);
+
 int socks5_auth(int sockfd, const char *server_host, const char *server_port, u_char cmd, int atype);
 
+size_t socks5_build_request(u_char *buf, const char *server_host, const char *server_port, u_char cmd, int atype);
+
+size_t socks5_reply_len(const u_char *buf, size_t len);
+
+void socks5_handshake_init(void);
+
+int socks5_handshake_start(socks5_handshake *hs, const char *proxy_host, const char *proxy_port,
+                           const char *server_host, const char *server_port, u_char cmd, int atype,
+                           socks5_handshake_cb cb, socks5_early_cb early, void *data);
+
+int socks5_handshake_resume(socks5_handshake *hs, int fd, const char *proxy_host, const char *proxy_port,
+                            const char *server_host, const char *server_port, u_char cmd, int atype,
+                            socks5_handshake_cb cb, socks5_early_cb early, void *data);
+
+void socks5_handshake_abort(socks5_handshake *hs);
+
 
 #endif //LWIP_SOCKS5_H
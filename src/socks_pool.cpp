@@ -0,0 +1,222 @@
+#include "socket_util.h"
+#include "struct.h"
+#include "util.h"
+#include "relay_stats.h"
+#include "sys_clock.h"
+#include "socks_pool.h"
+
+#include "lwip/def.h"
+
+enum socks_pool_states {
+    SP_EMPTY = 0,
+    SP_FILLING, /* greeting in progress */
+    SP_IDLE     /* greeted, waiting to be taken */
+};
+
+typedef struct socks_pool_conn {
+    socks5_handshake hs;
+    upstream *up;
+    /* watches an idle socket, readable means the server closed it */
+    ev_io idle_io;
+    u32_t idle_since;
+    u8_t state;
+} socks_pool_conn;
+
+/* pool_size slots per upstream, those of upstream i start at i * pool_size */
+static socks_pool_conn *pool;
+static int pool_size;
+static u32_t idle_ttl;
+
+/* per upstream, failed fills in a row, refills back off while > 0 */
+static u32_t fail_streak[UPSTREAM_MAX];
+static u32_t next_fill[UPSTREAM_MAX];
+
+static ev_timer refill_watcher;
+
+static void socks_pool_fill(upstream *up);
+
+static void
+socks_pool_drop(socks_pool_conn *c) {
+    if (c->state == SP_IDLE) {
+        relay_stats.pool_idle--;
+    }
+    ev_io_stop(EV_DEFAULT, &c->idle_io);
+    if (c->hs.fd > 0) {
+        close(c->hs.fd);
+    }
+    c->hs.fd = -1;
+    c->state = SP_EMPTY;
+}
+
+static void
+socks_pool_idle_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
+    socks_pool_conn *c = container_of(watcher, socks_pool_conn, idle_io);
+    relay_stats.pool_dead++;
+    /* refilled from socks_pool_refill_cb, not in a tight loop */
+    socks_pool_drop(c);
+}
+
+static void
+socks_pool_filled_cb(socks5_handshake *hs, int ok) {
+    socks_pool_conn *c = (socks_pool_conn *) hs->data;
+
+    if (!ok) {
+        /* hs->fd is already closed */
+        c->state = SP_EMPTY;
+        relay_stats.pool_fill_failed++;
+        upstream_failed(c->up);
+        fail_streak[c->up->index]++;
+        next_fill[c->up->index] = sys_clock_now() + LWIP_MIN(fail_streak[c->up->index], 30) * 1000;
+        return;
+    }
+
+    fail_streak[c->up->index] = 0;
+    upstream_latency(c->up, sys_clock_now() - hs->started);
+    c->state = SP_IDLE;
+    c->idle_since = sys_clock_now();
+    ev_io_init(&c->idle_io, socks_pool_idle_cb, hs->fd, EV_READ);
+    ev_io_start(EV_DEFAULT, &c->idle_io);
+    relay_stats.pool_idle++;
+}
+
+/**
+ * start greeting a socket for every empty slot of up, unless its last fills failed
+ */
+static void
+socks_pool_fill(upstream *up) {
+    int u = up->index;
+    if (fail_streak[u] > 0 && (s32_t) (sys_clock_now() - next_fill[u]) < 0) {
+        return;
+    }
+    for (int i = u * pool_size; i < (u + 1) * pool_size; i++) {
+        socks_pool_conn *c = &pool[i];
+        if (c->state != SP_EMPTY) {
+            continue;
+        }
+        if (socks5_handshake_start(&c->hs, up->host, up->port, NULL, NULL, 0, 0,
+                                   socks_pool_filled_cb, NULL, c) < 0) {
+            relay_stats.pool_fill_failed++;
+            upstream_failed(up);
+            fail_streak[u]++;
+            next_fill[u] = sys_clock_now() + LWIP_MIN(fail_streak[u], 30) * 1000;
+            return;
+        }
+        c->state = SP_FILLING;
+    }
+}
+
+/**
+ * expire sockets idle for longer than socks_pool_idle_ttl, servers tend to
+ * close idle connections on their own and we would find out too late
+ */
+static void
+socks_pool_refill_cb(struct ev_loop *loop, ev_timer *watcher, int revents) {
+    u32_t now = sys_clock_now();
+    for (int i = 0; i < pool_size * upstream_count(); i++) {
+        socks_pool_conn *c = &pool[i];
+        if (c->state == SP_IDLE && now - c->idle_since >= idle_ttl) {
+            relay_stats.pool_expired++;
+            socks_pool_drop(c);
+        }
+    }
+    for (int u = 0; u < upstream_count(); u++) {
+        socks_pool_fill(upstream_at(u));
+    }
+}
+
+void
+socks_pool_init(void) {
+    pool_size = conf_int(conf->socks_pool_size, 0);
+    idle_ttl = (u32_t) conf_int(conf->socks_pool_idle_ttl, 30000);
+    if (pool_size <= 0) {
+        pool_size = 0;
+        return;
+    }
+
+    int slots = pool_size * upstream_count();
+    pool = (socks_pool_conn *) malloc(sizeof(socks_pool_conn) * slots);
+    memset(pool, 0, sizeof(socks_pool_conn) * slots);
+    for (int i = 0; i < slots; i++) {
+        pool[i].hs.fd = -1;
+        pool[i].up = upstream_at(i / pool_size);
+    }
+
+    ev_timer_init(&refill_watcher, socks_pool_refill_cb, 1., 1.);
+    ev_timer_start(EV_DEFAULT, &refill_watcher);
+    for (int u = 0; u < upstream_count(); u++) {
+        socks_pool_fill(upstream_at(u));
+    }
+}
+
+int
+socks_pool_take(upstream *up) {
+    for (int i = up->index * pool_size; i < (up->index + 1) * pool_size; i++) {
+        socks_pool_conn *c = &pool[i];
+        if (c->state != SP_IDLE) {
+            continue;
+        }
+        /* the server may have closed it since the last poll */
+        char probe;
+        ssize_t n = recv(c->hs.fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            relay_stats.pool_dead++;
+            socks_pool_drop(c);
+            continue;
+        }
+
+        int fd = c->hs.fd;
+        ev_io_stop(EV_DEFAULT, &c->idle_io);
+        c->hs.fd = -1;
+        c->state = SP_EMPTY;
+        relay_stats.pool_idle--;
+        relay_stats.pool_hits++;
+        socks_pool_fill(up);
+        return fd;
+    }
+    if (pool_size > 0) {
+        relay_stats.pool_misses++;
+        socks_pool_fill(up);
+    }
+    return -1;
+}
+
+int
+socks_pool_handshake(upstream *up, socks5_handshake *hs, const char *server_host, const char *server_port,
+                     u_char cmd, int atype, socks5_handshake_cb cb, socks5_early_cb early, void *data) {
+    int fd = socks_pool_take(up);
+    if (fd >= 0) {
+        if (socks5_handshake_resume(hs, fd, up->host, up->port, server_host, server_port,
+                                    cmd, atype, cb, early, data) < 0) {
+            close(fd);
+            return -1;
+        }
+        return 0;
+    }
+    return socks5_handshake_start(hs, up->host, up->port, server_host, server_port,
+                                  cmd, atype, cb, early, data);
+}
+
+int
+socks_pool_connect(upstream *up) {
+    int fd = socks_pool_take(up);
+    if (fd >= 0) {
+        setblocking(fd);
+        return fd;
+    }
+    if (up->down) {
+        /* picked with all servers down, do not block the loop on a connect timeout */
+        return -1;
+    }
+
+    fd = socks5_connect(up->host, up->port);
+    if (fd < 1) {
+        upstream_failed(up);
+        return -1;
+    }
+    if (socks5_greet(fd) < 0) {
+        close(fd);
+        upstream_failed(up);
+        return -1;
+    }
+    return fd;
+}
@@ -0,0 +1,33 @@
+#ifndef IP2SOCKS_SOCKS_POOL_H
+#define IP2SOCKS_SOCKS_POOL_H
+
+#include "socks5.h"
+#include "upstream.h"
+
+/**
+ * Keeps socks_pool_size idle sockets to each socks server that are already
+ * connected and past the method exchange, so a new flow only pays the
+ * request round trip. Idle sockets are dropped when the server closes
+ * them or after socks_pool_idle_ttl, and refilled in the background.
+ */
+void socks_pool_init(void);
+
+/**
+ * @return a non blocking, greeted socket to the socks server, -1 if none is idle
+ */
+int socks_pool_take(upstream *up);
+
+/**
+ * socks5_handshake_start, or socks5_handshake_resume on a pooled socket
+ */
+int socks_pool_handshake(upstream *up, socks5_handshake *hs, const char *server_host, const char *server_port,
+                         u_char cmd, int atype, socks5_handshake_cb cb, socks5_early_cb early, void *data);
+
+/**
+ * blocking variant for the udp paths
+ *
+ * @return a blocking, greeted socket to the socks server, -1 on error
+ */
+int socks_pool_connect(upstream *up);
+
+#endif //IP2SOCKS_SOCKS_POOL_H
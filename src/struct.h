@@ -10,6 +10,13 @@ struct Conf {
     char *dns_mode;
     char *socks_server;
     char *socks_port;
+    char *socks_servers;
+    char *socks_balance;
+    char *socks_affinity;
+    char *socks_health_interval;
+    char *socks_health_fails;
+    char *socks_health_rises;
+    char *socks_health_target;
     char *remote_dns_server;
     char *remote_dns_port;
     char *local_dns_port;
@@ -20,6 +27,31 @@ struct Conf {
     char *netmask;
     char *after_start_shell;
     char *before_shutdown_shell;
+    char *syn_backlog;
+    char *syn_rate_per_source;
+    char *syn_burst_per_source;
+    char *max_connections;
+    char *relay_evict_min_idle;
+    char *relay_buffer_size;
+    char *relay_buffer_max_bytes;
+    char *relay_idle_timeout;
+    char *zerocopy_threshold;
+    char *ooseq_max_bytes_per_conn;
+    char *ooseq_max_pbufs_per_conn;
+    char *ooseq_max_bytes;
+    char *ooseq_max_pbufs;
+    char *socks_connect_timeout;
+    char *socks_handshake_timeout;
+    char *socks_pipeline;
+    char *socks_fastopen;
+    char *socks_hedge_delay;
+    char *mux_server;
+    char *mux_connections;
+    char *socks_autotune;
+    char *socks_autotune_interval;
+    char *socks_buffer_max;
+    char *socks_pool_size;
+    char *socks_pool_idle_ttl;
     std::vector<std::vector<std::string> > domains;
 };
 
@@ -0,0 +1,123 @@
+#include <string.h>
+
+#include "lwip/opt.h"
+#include "lwip/ip.h"
+
+#include "struct.h"
+#include "util.h"
+#include "relay_stats.h"
+#include "sys_clock.h"
+#include "tcp_raw.h"
+#include "syn_guard.h"
+
+#define SYN_GUARD_SLOTS 4096
+
+#define TCP_FLAG_SYN 0x02
+#define TCP_FLAG_ACK 0x10
+
+/* token bucket per source address, hashed into a fixed table */
+struct syn_bucket {
+    u32_t addr;
+    double tokens;
+    u32_t last;
+};
+
+static struct syn_bucket buckets[SYN_GUARD_SLOTS];
+
+static netif_input_fn next_input;
+static u16_t link_hlen;
+
+static double syn_rate;
+static double syn_burst;
+
+static struct syn_bucket *
+syn_guard_bucket(u32_t addr) {
+    u32_t h = addr * 2654435761u;
+    return &buckets[(h >> 16) % SYN_GUARD_SLOTS];
+}
+
+/**
+ * @return 1 when a SYN from addr is within its rate, 0 to drop it
+ */
+static int
+syn_guard_take(u32_t addr) {
+    struct syn_bucket *b = syn_guard_bucket(addr);
+    u32_t now = sys_clock_now();
+
+    if (b->addr != addr) {
+        /* new source, or it took over the slot of an idle one */
+        b->addr = addr;
+        b->tokens = syn_burst;
+    } else {
+        b->tokens += (now - b->last) / 1000. * syn_rate;
+        if (b->tokens > syn_burst) {
+            b->tokens = syn_burst;
+        }
+    }
+    b->last = now;
+
+    if (b->tokens < 1.) {
+        return 0;
+    }
+    b->tokens -= 1.;
+    return 1;
+}
+
+static err_t
+syn_guard_input(struct pbuf *p, struct netif *inp) {
+    const u8_t *iph = (const u8_t *) p->payload + link_hlen;
+
+    if (p->len < link_hlen + 20 || (iph[0] >> 4) != 4 || iph[9] != IP_PROTO_TCP) {
+        return next_input(p, inp);
+    }
+    if (link_hlen != 0) {
+        const u8_t *eth = (const u8_t *) p->payload;
+        if (eth[12] != 0x08 || eth[13] != 0x00) {
+            return next_input(p, inp);
+        }
+    }
+
+    u16_t ihl = (u16_t) ((iph[0] & 0x0f) * 4);
+    if (p->len < link_hlen + ihl + 20) {
+        return next_input(p, inp);
+    }
+    u8_t flags = iph[ihl + 13];
+    if ((flags & (TCP_FLAG_SYN | TCP_FLAG_ACK)) != TCP_FLAG_SYN) {
+        return next_input(p, inp);
+    }
+
+    relay_stats.syn_seen++;
+
+    u32_t src;
+    memcpy(&src, iph + 12, sizeof(src));
+    if (!syn_guard_take(src)) {
+        relay_stats.syn_dropped_rate++;
+        pbuf_free(p);
+        return ERR_OK;
+    }
+
+    if (tcp_raw_backlog_full()) {
+        relay_stats.syn_dropped_backlog++;
+        pbuf_free(p);
+        return ERR_OK;
+    }
+
+    if (!tcp_raw_can_admit()) {
+        relay_stats.syn_dropped_capacity++;
+        pbuf_free(p);
+        return ERR_OK;
+    }
+
+    relay_stats.syn_admitted++;
+    return next_input(p, inp);
+}
+
+void
+syn_guard_init(struct netif *netif) {
+    syn_rate = conf_int(conf->syn_rate_per_source, 50);
+    syn_burst = conf_int(conf->syn_burst_per_source, 100);
+
+    link_hlen = (netif->flags & NETIF_FLAG_ETHARP) ? SIZEOF_ETH_HDR : 0;
+    next_input = netif->input;
+    netif->input = syn_guard_input;
+}
@@ -0,0 +1,12 @@
+#ifndef IP2SOCKS_SYN_GUARD_H
+#define IP2SOCKS_SYN_GUARD_H
+
+#include "lwip/netif.h"
+
+/**
+ * Drops TCP SYNs before they reach lwip when a source exceeds its accept
+ * rate or when the catch-all listener's SYN backlog is full.
+ */
+void syn_guard_init(struct netif *netif);
+
+#endif //IP2SOCKS_SYN_GUARD_H
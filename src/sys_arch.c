@@ -0,0 +1,55 @@
+/**
+ * based on lwip-contrib ports/unix/port/sys_arch.c, NO_SYS only
+ *
+ * lwip asks for the time in its input and output paths. Instead of one
+ * gettimeofday per sys_now() the clock is read once per event loop
+ * iteration (sys_clock_update) and sys_now() returns the cached value.
+ */
+#include <time.h>
+
+#include "lwip/opt.h"
+#include "lwip/sys.h"
+
+#include "sys_clock.h"
+
+#if defined(CLOCK_MONOTONIC_COARSE)
+#define SYS_CLOCK_ID CLOCK_MONOTONIC_COARSE
+#else
+#define SYS_CLOCK_ID CLOCK_MONOTONIC
+#endif
+
+static u32_t sys_clock_ms;
+
+/* calls answered from the cache, and actual clock reads */
+unsigned long long sys_clock_calls;
+unsigned long long sys_clock_reads;
+
+void
+sys_clock_update(void) {
+    struct timespec ts;
+
+    clock_gettime(SYS_CLOCK_ID, &ts);
+    sys_clock_reads++;
+    sys_clock_ms = (u32_t) ts.tv_sec * 1000 + (u32_t) (ts.tv_nsec / 1000000);
+}
+
+void
+sys_init(void) {
+    sys_clock_update();
+}
+
+u32_t
+sys_jiffies(void) {
+    return sys_now();
+}
+
+u32_t
+sys_now(void) {
+    sys_clock_calls++;
+    return sys_clock_ms;
+}
+
+u32_t
+sys_clock_now(void) {
+    return sys_clock_ms;
+}
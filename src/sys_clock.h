@@ -0,0 +1,28 @@
+#ifndef IP2SOCKS_SYS_CLOCK_H
+#define IP2SOCKS_SYS_CLOCK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lwip/arch.h"
+
+/**
+ * Millisecond clock shared by lwip (sys_now) and the relays. It only moves
+ * when sys_clock_update() is called, once per event loop iteration.
+ */
+void sys_clock_update(void);
+
+u32_t sys_now(void);
+
+/* same clock for relay state timestamps, not counted in sys_clock_calls */
+u32_t sys_clock_now(void);
+
+extern unsigned long long sys_clock_calls;
+extern unsigned long long sys_clock_reads;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //IP2SOCKS_SYS_CLOCK_H
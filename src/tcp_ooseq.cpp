@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <vector>
+
+#include "ev.h"
+
+#include "lwip/opt.h"
+#include "lwip/stats.h"
+#include "lwip/memp.h"
+#include "lwip/tcp.h"
+#include "lwip/priv/tcp_priv.h"
+
+#include "struct.h"
+#include "util.h"
+#include "relay_stats.h"
+#include "sys_clock.h"
+#include "tcp_raw.h"
+#include "tcp_ooseq.h"
+
+#if LWIP_TCP && TCP_QUEUE_OOSEQ
+
+static ev_timer ooseq_watcher;
+
+static u32_t max_bytes_per_conn;
+static u32_t max_pbufs_per_conn;
+static u32_t max_bytes;
+static u32_t max_pbufs;
+
+struct ooseq_entry {
+    u32_t since;
+    struct tcp_pcb *pcb;
+    u32_t bytes;
+    u32_t pbufs;
+};
+
+static bool
+ooseq_older(const ooseq_entry &a, const ooseq_entry &b) {
+    return (s32_t) (a.since - b.since) < 0;
+}
+
+/**
+ * Drop the tail of pcb's ooseq above the per connection limits, the same
+ * way lwip does for TCP_OOSEQ_MAX_BYTES/TCP_OOSEQ_MAX_PBUFS.
+ */
+static void
+tcp_ooseq_trim(struct tcp_pcb *pcb, u32_t *bytes, u32_t *pbufs) {
+    struct tcp_seg *prev = NULL;
+    u32_t blen = 0;
+    u32_t qlen = 0;
+
+    for (struct tcp_seg *seg = pcb->ooseq; seg != NULL; prev = seg, seg = seg->next) {
+        u32_t seg_blen = seg->p->tot_len;
+        u32_t seg_qlen = pbuf_clen(seg->p);
+
+        if (blen + seg_blen > max_bytes_per_conn || qlen + seg_qlen > max_pbufs_per_conn) {
+            if (prev == NULL) {
+                tcp_free_ooseq(pcb);
+            } else {
+                prev->next = NULL;
+                tcp_segs_free(seg);
+            }
+            relay_stats.ooseq_trimmed++;
+            break;
+        }
+        blen += seg_blen;
+        qlen += seg_qlen;
+    }
+    *bytes = blen;
+    *pbufs = qlen;
+}
+
+static int
+tcp_ooseq_pressure(void) {
+#if MEMP_POOL_MODE && MEMP_STATS
+    struct stats_mem *pool = lwip_stats.memp[MEMP_PBUF_POOL];
+    struct stats_mem *segs = lwip_stats.memp[MEMP_TCP_SEG];
+    return pool->used * 4 >= pool->avail * 3 || segs->used * 4 >= segs->avail * 3;
+#else
+    return 0;
+#endif
+}
+
+static void
+tcp_ooseq_cb(struct ev_loop *loop, ev_timer *watcher, int revents) {
+    std::vector<ooseq_entry> queued;
+    u32_t total_bytes = 0;
+    u32_t total_pbufs = 0;
+    u32_t now = sys_clock_now();
+
+    for (struct tcp_pcb *pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next) {
+        struct tcp_raw_state *es = tcp_raw_state_of(pcb);
+
+        if (pcb->ooseq == NULL) {
+            if (es != NULL) {
+                es->ooseq_since = 0;
+            }
+            continue;
+        }
+
+        ooseq_entry entry;
+        entry.pcb = pcb;
+        tcp_ooseq_trim(pcb, &entry.bytes, &entry.pbufs);
+        if (pcb->ooseq == NULL) {
+            continue;
+        }
+        if (es != NULL) {
+            if (es->ooseq_since == 0) {
+                es->ooseq_since = now;
+            }
+            entry.since = es->ooseq_since;
+        } else {
+            entry.since = now;
+        }
+        total_bytes += entry.bytes;
+        total_pbufs += entry.pbufs;
+        queued.push_back(entry);
+    }
+
+    int pressure = tcp_ooseq_pressure();
+    if (total_bytes > max_bytes || total_pbufs > max_pbufs || pressure) {
+        /* discard the oldest out of sequence data first */
+        std::sort(queued.begin(), queued.end(), ooseq_older);
+        for (size_t i = 0; i < queued.size(); ++i) {
+            if (total_bytes <= max_bytes && total_pbufs <= max_pbufs && !pressure) {
+                break;
+            }
+            tcp_free_ooseq(queued[i].pcb);
+            total_bytes -= queued[i].bytes;
+            total_pbufs -= queued[i].pbufs;
+            relay_stats.ooseq_discarded++;
+            pressure = tcp_ooseq_pressure();
+        }
+    }
+
+    relay_stats.ooseq_bytes = total_bytes;
+    relay_stats.ooseq_pbufs = total_pbufs;
+    if (total_bytes > relay_stats.ooseq_peak_bytes) {
+        relay_stats.ooseq_peak_bytes = total_bytes;
+    }
+}
+
+void
+tcp_ooseq_init(void) {
+    max_bytes_per_conn = (u32_t) conf_int(conf->ooseq_max_bytes_per_conn, TCP_OOSEQ_MAX_BYTES);
+    max_pbufs_per_conn = (u32_t) conf_int(conf->ooseq_max_pbufs_per_conn, TCP_OOSEQ_MAX_PBUFS);
+    max_bytes = (u32_t) conf_int(conf->ooseq_max_bytes, 8 * 1024 * 1024);
+    max_pbufs = (u32_t) conf_int(conf->ooseq_max_pbufs, PBUF_POOL_SIZE / 4);
+
+    ev_timer_init(&ooseq_watcher, tcp_ooseq_cb, TCP_TMR_INTERVAL / 1000., TCP_TMR_INTERVAL / 1000.);
+    ev_timer_start(EV_DEFAULT, &ooseq_watcher);
+}
+
+#else
+
+void
+tcp_ooseq_init(void) {
+}
+
+#endif /* LWIP_TCP && TCP_QUEUE_OOSEQ */
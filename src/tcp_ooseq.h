@@ -0,0 +1,10 @@
+#ifndef IP2SOCKS_TCP_OOSEQ_H
+#define IP2SOCKS_TCP_OOSEQ_H
+
+/**
+ * Caps the out of sequence queues of all lwip tcp pcbs, per connection and
+ * globally, and accounts their occupancy in relay_stats.
+ */
+void tcp_ooseq_init(void);
+
+#endif //IP2SOCKS_TCP_OOSEQ_H
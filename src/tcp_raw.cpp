@@ -8,90 +8,674 @@
 #include <string.h>
 
 #include "socks5.h"
+#include "socks_pool.h"
 #include "struct.h"
 #include "var.h"
+#include "util.h"
+#include "relay_stats.h"
+#include "object_pool.h"
+#include "tcp_ooseq.h"
 #include "tcp_raw.h"
 
 #include "lwip/opt.h"
 #include "lwip/stats.h"
 #include "lwip/tcp.h"
+#include "lwip/priv/tcp_priv.h"
+#include "lwip/memp.h"
 
 #if LWIP_TCP && LWIP_CALLBACK_API
 
 static struct tcp_pcb *tcp_raw_pcb;
-static ev_timer timeout_watcher;
+static ev_check flush_watcher;
 
+/* relays with data queued by tcp_write but not yet tcp_output */
+static struct tcp_raw_state *dirty_list;
 
-static ev_tstamp timeout = 60.;
+/* all relays, lru_head is the most recently active one */
+static struct tcp_raw_state *lru_head;
+static struct tcp_raw_state *lru_tail;
+static u32_t relay_capacity;
+/* ms a relay must have been idle before tcp_raw_admit may close it */
+static u32_t evict_min_idle;
 
-static void tcp_raw_send(struct tcp_pcb *tpcb, struct tcp_raw_state *es);
+static object_pool<tcp_raw_state> state_pool("tcp_raw_state");
+static object_pool<tcp_raw_linger> linger_pool("tcp_raw_linger");
 
 
+/* ms without data in either direction before a relay is closed, 0 never */
+static u32_t idle_timeout;
+
+/* bytes read from socks_fd and not yet tcp_write, see tcp_raw_init */
+static u32_t pending_max;
+
+/**
+ * bytes all relays may hold in blocks and upq together, 0 no limit. Reads
+ * pause when a block would exceed it and resume below buffer_low, new
+ * relays are refused above buffer_high, see tcp_raw_admit.
+ */
+static u32_t buffer_budget;
+static u32_t buffer_high;
+static u32_t buffer_low;
+/* a read paused for the budget, tcp_raw_flush_cb resumes it */
+static u8_t buffer_starved;
+
+/* ms before a second socks handshake races a slow one, 0 never */
+static u32_t hedge_delay;
+
+enum tcp_raw_race {
+    RACE_PRIMARY = 1, /* es->hs */
+    RACE_HEDGE = 2    /* es->hedge */
+};
+
+/* most pbufs handed to one sendmsg */
+#define TCP_RAW_UPQ_IOV_MAX 64
+
+static int tcp_raw_send(struct tcp_pcb *tpcb, struct tcp_raw_state *es);
+
+static void send_data_lwip(struct tcp_pcb *pcb, struct tcp_raw_state *es);
+
+static void tcp_raw_read_resume(struct tcp_raw_state *es);
+
+static int tcp_raw_admit(int *evict);
+
+static void tcp_raw_evict(void);
+
+
+static void
+tcp_raw_mark_dirty(struct tcp_raw_state *es) {
+    if (!es->dirty) {
+        es->dirty = 1;
+        es->dirty_prev = NULL;
+        es->dirty_next = dirty_list;
+        if (dirty_list != NULL) {
+            dirty_list->dirty_prev = es;
+        }
+        dirty_list = es;
+    }
+}
+
+static void
+tcp_raw_clear_dirty(struct tcp_raw_state *es) {
+    if (es->dirty) {
+        if (es->dirty_prev != NULL) {
+            es->dirty_prev->dirty_next = es->dirty_next;
+        } else {
+            dirty_list = es->dirty_next;
+        }
+        if (es->dirty_next != NULL) {
+            es->dirty_next->dirty_prev = es->dirty_prev;
+        }
+        es->dirty = 0;
+        es->dirty_prev = NULL;
+        es->dirty_next = NULL;
+    }
+}
+
+/**
+ * the budget has room again: every relay paused for it reads once more,
+ * those that get no block pause again
+ */
+static void
+tcp_raw_budget_resume(void) {
+    buffer_starved = 0;
+    for (struct tcp_raw_state *es = lru_head; es != NULL; es = es->lru_next) {
+        if (es->budget_paused) {
+            es->budget_paused = 0;
+            tcp_raw_read_resume(es);
+        }
+    }
+}
+
+/**
+ * Runs once per loop iteration, after every other watcher: push all data
+ * queued by tcp_write during this iteration out as full sized segments.
+ */
+static void
+tcp_raw_flush_cb(struct ev_loop *loop, ev_check *watcher, int revents) {
+    if (buffer_starved && relay_stats.buffer_bytes <= buffer_low) {
+        tcp_raw_budget_resume();
+    }
+    if (dirty_list == NULL) {
+        return;
+    }
+
+    relay_stats.flushes++;
+    while (dirty_list != NULL) {
+        struct tcp_raw_state *es = dirty_list;
+        struct tcp_pcb *pcb = es->pcb;
+        tcp_raw_clear_dirty(es);
+
+        if (pcb == NULL) {
+            continue;
+        }
+        u16_t xmit = lwip_stats.tcp.xmit;
+        u32_t snd_nxt = pcb->snd_nxt;
+
+        err_t wr_err = tcp_output(pcb);
+        if (wr_err != ERR_OK) {
+            printf("<---------------------------------- tcp_output wr_wrr is %s\n", lwip_strerr(wr_err));
+            continue;
+        }
+        relay_stats.flushed_pcbs++;
+        relay_stats.flushed_segments += (u16_t) (lwip_stats.tcp.xmit - xmit);
+        relay_stats.flushed_bytes += pcb->snd_nxt - snd_nxt;
+    }
+}
+
+static void
+tcp_raw_lru_link(struct tcp_raw_state *es) {
+    es->lru_prev = NULL;
+    es->lru_next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->lru_prev = es;
+    } else {
+        lru_tail = es;
+    }
+    lru_head = es;
+}
+
+static void
+tcp_raw_lru_unlink(struct tcp_raw_state *es) {
+    if (es->lru_prev != NULL) {
+        es->lru_prev->lru_next = es->lru_next;
+    } else {
+        lru_head = es->lru_next;
+    }
+    if (es->lru_next != NULL) {
+        es->lru_next->lru_prev = es->lru_prev;
+    } else {
+        lru_tail = es->lru_prev;
+    }
+    es->lru_prev = NULL;
+    es->lru_next = NULL;
+}
+
+/**
+ * data moved in either direction, es becomes the most recently active relay
+ */
+static void timeout_cb(timer_wheel_node *node);
+
+static void
+tcp_raw_touch(struct tcp_raw_state *es) {
+    es->last_active = sys_clock_now();
+    if (idle_timeout > 0) {
+        timer_wheel_arm(&es->idle, idle_timeout, timeout_cb);
+    }
+    if (lru_head != es) {
+        tcp_raw_lru_unlink(es);
+        tcp_raw_lru_link(es);
+    }
+}
+
+static void
+tcp_raw_buffer_add(u32_t len) {
+    relay_stats.buffer_bytes += len;
+    if (relay_stats.buffer_bytes > relay_stats.buffer_peak) {
+        relay_stats.buffer_peak = relay_stats.buffer_bytes;
+    }
+}
+
+/**
+ * Queue p on es->upq as received, the payload is sent from the pbufs.
+ * Chains are linked through next without updating tot_len (a queue can
+ * hold more than 0xffff bytes), it is only ever walked by len.
+ */
+static void
+tcp_raw_upq_append(struct tcp_raw_state *es, struct pbuf *p) {
+    struct pbuf *last = p;
+    while (last->next != NULL) {
+        last = last->next;
+    }
+    if (es->upq == NULL) {
+        es->upq = p;
+        es->upq_off = 0;
+    } else {
+        es->upq_last->next = p;
+    }
+    es->upq_last = last;
+    es->upq_len += p->tot_len;
+    tcp_raw_buffer_add(p->tot_len);
+}
+
+/**
+ * drop len bytes from the head of es->upq, freeing pbufs fully sent
+ */
+static void
+tcp_raw_upq_consume(struct tcp_raw_state *es, u32_t len) {
+    es->upq_len -= len;
+    relay_stats.buffer_bytes -= len;
+    while (len > 0 && es->upq != NULL) {
+        struct pbuf *q = es->upq;
+        u32_t avail = q->len - es->upq_off;
+        if (len < avail) {
+            es->upq_off += len;
+            return;
+        }
+        len -= avail;
+        es->upq = q->next;
+        es->upq_off = 0;
+        q->next = NULL;
+        q->tot_len = q->len;
+        pbuf_free(q);
+    }
+    while (es->upq != NULL && es->upq->len == es->upq_off) {
+        /* empty pbufs left at the head */
+        struct pbuf *q = es->upq;
+        es->upq = q->next;
+        es->upq_off = 0;
+        q->next = NULL;
+        q->tot_len = q->len;
+        pbuf_free(q);
+    }
+    if (es->upq == NULL) {
+        es->upq_last = NULL;
+    }
+}
+
+/**
+ * @param budgeted 0 for data that has already arrived and must be taken
+ * @return NULL when out of memory, or of budget for a budgeted block
+ */
+static tcp_raw_block *
+tcp_raw_block_new(int budgeted) {
+    if (budgeted && buffer_budget > 0 && relay_stats.buffer_bytes + TCP_RAW_BLOCK_SIZE > buffer_budget) {
+        relay_stats.buffer_budget_paused++;
+        buffer_starved = 1;
+        return NULL;
+    }
+    tcp_raw_block *b = (tcp_raw_block *) malloc(sizeof(tcp_raw_block) + TCP_RAW_BLOCK_SIZE);
+    if (b == NULL) {
+        return NULL;
+    }
+    tcp_raw_buffer_add(TCP_RAW_BLOCK_SIZE);
+    memset(b, 0, sizeof(tcp_raw_block));
+    b->size = TCP_RAW_BLOCK_SIZE;
+    /* the relay's reference, until it has received and queued the whole block */
+    b->ref = 1;
+    b->relay_ref = 1;
+    relay_stats.download_blocks++;
+    return b;
+}
+
+/**
+ * drop one reference of b, unlinking it from the list at *head at zero
+ */
+static void
+tcp_raw_block_put(tcp_raw_block **head, tcp_raw_block *b) {
+    if (--b->ref > 0) {
+        return;
+    }
+    while (*head != b) {
+        head = &(*head)->next;
+    }
+    *head = b->next;
+    relay_stats.buffer_bytes -= b->size;
+    free(b);
+}
+
+/**
+ * the client acknowledged len more bytes, lwip no longer holds them
+ */
+static void
+tcp_raw_blocks_acked(tcp_raw_block **head, u32_t len) {
+    while (len > 0 && *head != NULL) {
+        tcp_raw_block *b = *head;
+        u32_t n = LWIP_MIN(len, b->queued - b->acked);
+        if (n == 0) {
+            /* nothing of ours in flight, e.g. the ack of our FIN */
+            break;
+        }
+        b->acked += n;
+        len -= n;
+        if (b->acked == b->queued) {
+            tcp_raw_block_put(head, b);
+        }
+    }
+}
+
+/**
+ * the relay is gone: drop its references, data still in flight keeps its block
+ */
+static void
+tcp_raw_blocks_release(tcp_raw_block **head) {
+    tcp_raw_block *b = *head;
+    while (b != NULL) {
+        tcp_raw_block *next = b->next;
+        if (b->relay_ref) {
+            b->relay_ref = 0;
+            tcp_raw_block_put(head, b);
+        }
+        b = next;
+    }
+}
+
+/**
+ * The relay keeps its last block until it is full, an idle relay would
+ * hold TCP_RAW_BLOCK_SIZE of the budget for good. Once all that was
+ * received into it is acknowledged the block goes, the next read takes a
+ * fresh one.
+ */
+static void
+tcp_raw_blocks_trim(struct tcp_raw_state *es) {
+    tcp_raw_block *b = es->blk_tail;
+    if (b == NULL || !b->relay_ref || b->acked != b->fill) {
+        return;
+    }
+    b->relay_ref = 0;
+    tcp_raw_block_put(&es->blk_head, b);
+    es->blk_tail = es->blk_head;
+    while (es->blk_tail != NULL && es->blk_tail->next != NULL) {
+        es->blk_tail = es->blk_tail->next;
+    }
+}
+
+/**
+ * the pcb is gone (aborted or reset), lwip holds nothing anymore
+ */
+static void
+tcp_raw_blocks_free(tcp_raw_block **head) {
+    while (*head != NULL) {
+        tcp_raw_block *b = *head;
+        *head = b->next;
+        relay_stats.buffer_bytes -= b->size;
+        free(b);
+    }
+}
+
+static err_t
+tcp_raw_linger_sent(void *arg, struct tcp_pcb *tpcb, u16_t len) {
+    tcp_raw_linger *lg = (tcp_raw_linger *) arg;
+
+    tcp_raw_blocks_acked(&lg->blocks, len);
+    if (lg->blocks == NULL) {
+        tcp_arg(tpcb, NULL);
+        tcp_sent(tpcb, NULL);
+        tcp_err(tpcb, NULL);
+        relay_stats.download_lingering--;
+        linger_pool.release(lg);
+    }
+    return ERR_OK;
+}
+
+static void
+tcp_raw_linger_error(void *arg, err_t err) {
+    tcp_raw_linger *lg = (tcp_raw_linger *) arg;
+
+    LWIP_UNUSED_ARG(err);
+    tcp_raw_blocks_free(&lg->blocks);
+    relay_stats.download_lingering--;
+    linger_pool.release(lg);
+}
+
+/**
+ * Detach es from its pcb before tcp_close. Blocks lwip may still
+ * retransmit from move to es->linger, which frees them once acknowledged,
+ * or when the pcb dies.
+ */
+static void
+tcp_raw_detach(struct tcp_pcb *tpcb, struct tcp_raw_state *es) {
+    tcp_recv(tpcb, NULL);
+    tcp_poll(tpcb, NULL, 0);
+
+    if (es != NULL) {
+        tcp_raw_blocks_release(&es->blk_head);
+        es->blk_tail = NULL;
+        es->pending = 0;
+    }
+    if (es != NULL && es->blk_head != NULL) {
+        tcp_raw_linger *lg = es->linger;
+        es->linger = NULL;
+        lg->blocks = es->blk_head;
+        es->blk_head = NULL;
+        relay_stats.download_lingering++;
+        tcp_arg(tpcb, lg);
+        tcp_sent(tpcb, tcp_raw_linger_sent);
+        tcp_err(tpcb, tcp_raw_linger_error);
+    } else {
+        tcp_arg(tpcb, NULL);
+        tcp_sent(tpcb, NULL);
+        tcp_err(tpcb, NULL);
+    }
+}
+
 static void
 tcp_raw_free(struct tcp_raw_state *es) {
     if (es != NULL) {
+        tcp_raw_clear_dirty(es);
+        tcp_raw_lru_unlink(es);
+        relay_stats.relay_live--;
         if (es->pcb != NULL) {
+            tcp_raw_detach(es->pcb, es);
             tcp_close(es->pcb);
         }
-        free(es);
+        tcp_raw_upq_consume(es, es->upq_len);
+        /* the pcb is gone or lingering with whatever lwip still needs */
+        tcp_raw_blocks_free(&es->blk_head);
+        linger_pool.release(es->linger);
+        upstream_release(es->up);
+        state_pool.release(es);
+    }
+}
+
+/**
+ * done with the socks side of es, socket or mux stream
+ */
+static void
+tcp_raw_close_upstream(struct tcp_raw_state *es) {
+    if (es->mux != NULL) {
+        mux_stream_close(es->mux);
+        es->mux = NULL;
+    }
+    if (es->socks_fd > 0) {
+        ev_io_stop(EV_DEFAULT, &(es->io));
+        ev_io_stop(EV_DEFAULT, &(es->wio));
+        sock_tune_stop(&es->tune);
+        zerocopy_close(&es->zc, es->socks_fd);
+        es->socks_fd = 0;
     }
 }
 
 static void
 tcp_raw_close(struct tcp_pcb *tpcb, struct tcp_raw_state *es) {
     if (tpcb != NULL) {
-        tcp_arg(tpcb, NULL);
-        tcp_sent(tpcb, NULL);
-        tcp_recv(tpcb, NULL);
-        tcp_err(tpcb, NULL);
-        tcp_poll(tpcb, NULL, 0);
+        tcp_raw_detach(tpcb, es);
         tcp_close(tpcb);
     }
 
     if (es != NULL) {
-        es->socks_buf_used = 0;
-        es->buf_used = 0;
-        if (es->socks_fd > 0) {
-            if (&(es->io) != NULL) {
-                close(es->socks_fd);
-                ev_io_stop(EV_DEFAULT, &(es->io));
-            }
+        /* tpcb is es->pcb, already closed above */
+        es->pcb = NULL;
+        /* a handshake still running, or the beaten one of a race */
+        if (es->racing & RACE_PRIMARY) {
+            socks5_handshake_abort(&es->hs);
+        }
+        if (es->racing & RACE_HEDGE) {
+            socks5_handshake_abort(&es->hedge);
         }
+        es->racing = 0;
+        timer_wheel_cancel(&es->hedge_timer);
+        upstream_release(es->hedge_up);
+        es->hedge_up = NULL;
+        tcp_raw_close_upstream(es);
 
+        timer_wheel_cancel(&es->idle);
 
-        if (es->block_ctx->watcher.active != 0) {
-            ev_timer_stop(EV_DEFAULT, &(es->block_ctx->watcher));
+        tcp_raw_free(es);
+    }
+}
+
+/**
+ * release both sides of es right away, tcp_abort frees the pcb immediately
+ */
+static void
+tcp_raw_abort(struct tcp_raw_state *es) {
+    struct tcp_pcb *pcb = es->pcb;
+
+    es->pcb = NULL;
+    if (pcb != NULL) {
+        tcp_arg(pcb, NULL);
+        tcp_sent(pcb, NULL);
+        tcp_recv(pcb, NULL);
+        tcp_err(pcb, NULL);
+        tcp_poll(pcb, NULL, 0);
+        tcp_abort(pcb);
+    }
+    tcp_raw_close(NULL, es);
+}
+
+/**
+ * Pass on each FIN once the data before it is through: to the socks
+ * server when upq is drained, to the client when all of pending is queued
+ * to lwip. A side done in both directions is released right away, the
+ * relay once both are.
+ *
+ * @return -1 if es has been closed
+ */
+static int
+tcp_raw_half_close(struct tcp_raw_state *es) {
+    if (es->state == ES_CLOSING && !es->up_shut && es->socks_connected && es->upq_len == 0) {
+        if (es->mux != NULL) {
+            mux_stream_shutdown(es->mux);
+        } else if (es->socks_fd > 0) {
+            ev_io_stop(EV_DEFAULT, &(es->wio));
+            shutdown(es->socks_fd, SHUT_WR);
         }
-        if (es->timeout_ctx->watcher.active != 0) {
-            ev_timer_stop(EV_DEFAULT, &(es->timeout_ctx->watcher));
+        es->up_shut = 1;
+        relay_stats.relay_half_closed_up++;
+    }
+    if (es->down_eof && !es->down_shut && es->pending == 0 && es->pcb != NULL) {
+        /* ERR_MEM leaves it for tcp_raw_sent or tcp_raw_poll to try again */
+        if (tcp_shutdown(es->pcb, 0, 1) == ERR_OK) {
+            es->down_shut = 1;
+            relay_stats.relay_half_closed_down++;
+            tcp_raw_mark_dirty(es);
         }
+    }
 
-        free(es->block_ctx);
-        free(es->timeout_ctx);
-
-        tcp_raw_free(es);
+    if (es->up_shut && es->down_shut) {
+        tcp_raw_close(es->pcb, es);
+        return -1;
+    }
+    if (es->state == ES_CLOSING && es->down_shut && es->pcb != NULL) {
+        /* both FINs are through lwip, the linger keeps what is unacknowledged */
+        struct tcp_pcb *pcb = es->pcb;
+        es->pcb = NULL;
+        tcp_raw_detach(pcb, es);
+        tcp_close(pcb);
     }
+    if (es->up_shut && es->down_eof) {
+        /* the server is done both ways, pending still drains to the client */
+        tcp_raw_close_upstream(es);
+    }
+    return 0;
 }
 
+/**
+ * open the receive window by len, which may be more than tcp_recved takes at once
+ */
 static void
-tcp_raw_send(struct tcp_pcb *tpcb, struct tcp_raw_state *es) {
-    if (es->buf_used > 0) {
-        // 缓冲区的数据全部发送
-        ssize_t ret = send(es->socks_fd, es->buf.c_str(), es->buf_used, 0);
+tcp_raw_recved(struct tcp_pcb *tpcb, u32_t len) {
+    if (tpcb == NULL) {
+        /* the client's side was released by tcp_raw_half_close */
+        return;
+    }
+    while (len > 0) {
+        u16_t chunk = (u16_t) LWIP_MIN(len, 0xffff);
+        tcp_recved(tpcb, chunk);
+        len -= chunk;
+    }
+}
 
-        if (ret > 0) {
-            u16_t plen = es->buf_used;
+/**
+ * write what es->upq holds to socks_fd. Whatever the socket does not take
+ * stays buffered and not tcp_recved, so the client's window closes as fast
+ * as the upstream drains, and write_cb sends it once the socket is writable.
+ *
+ * @return -1 if es has been closed
+ */
+static int
+tcp_raw_send(struct tcp_pcb *tpcb, struct tcp_raw_state *es) {
+    if (!es->socks_connected) {
+        /* keep buffering until the socks handshake is done */
+        return 0;
+    }
+    if (es->upq_len > 0) {
+        // 缓冲区的数据全部发送, 直接从 pbuf 发送
+        struct iovec iov[TCP_RAW_UPQ_IOV_MAX];
+        struct pbuf *iov_pbuf[TCP_RAW_UPQ_IOV_MAX];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+
+        u16_t off = es->upq_off;
+        for (struct pbuf *q = es->upq; q != NULL && msg.msg_iovlen < TCP_RAW_UPQ_IOV_MAX; q = q->next) {
+            if (q->len > off) {
+                iov[msg.msg_iovlen].iov_base = (char *) q->payload + off;
+                iov[msg.msg_iovlen].iov_len = q->len - off;
+                iov_pbuf[msg.msg_iovlen] = q;
+                msg.msg_iovlen++;
+            }
+            off = 0;
+        }
 
-            es->buf.clear();
-            es->buf_used = 0;
+        ssize_t ret;
+        if (es->mux != NULL) {
+            ret = (ssize_t) mux_stream_send(es->mux, iov, (int) msg.msg_iovlen);
+        } else if (zerocopy_wanted(&es->zc, es->upq_len)) {
+            ret = zerocopy_sendmsg(&es->zc, es->socks_fd, &msg, iov_pbuf);
+        } else {
+            ret = sendmsg(es->socks_fd, &msg, 0);
+        }
 
-            /* we can read more data now */
-            tcp_recved(tpcb, plen);
+        if (ret > 0) {
+            tcp_raw_upq_consume(es, (u32_t) ret);
+            if (es->mux == NULL) {
+                sock_tune_wrote(&es->tune, (size_t) ret);
+                es->up->bytes_up += ret;
+                relay_stats.upload_sendmsg++;
+                relay_stats.upload_iovecs += msg.msg_iovlen;
+            }
+            relay_stats.upload_bytes += ret;
+
+            /* we can read more data now, only as much as the socket took */
+            tcp_raw_recved(tpcb, (u32_t) ret);
+        } else if (es->mux != NULL) {
+            /* out of credit or session buffer, tcp_raw_mux_sent picks it up */
+        } else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            /* socket buffer full */
+            relay_stats.upstream_write_blocked++;
         } else {
             printf("<-------------------------------------- send to socks failed %ld\n", ret);
             tcp_raw_close(tpcb, es);
+            return -1;
         }
     }
+
+    if (es->mux != NULL) {
+        return 0;
+    }
+    if (es->upq_len > 0) {
+        ev_io_start(EV_DEFAULT, &(es->wio));
+    } else {
+        ev_io_stop(EV_DEFAULT, &(es->wio));
+    }
+    return 0;
+}
+
+/**
+ * socks_fd has room again, drain es->upq
+ */
+static void
+write_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
+    struct tcp_raw_state *es = container_of(watcher, struct tcp_raw_state, wio);
+
+    if (zerocopy_pending(&es->zc)) {
+        zerocopy_reap(&es->zc, es->socks_fd);
+    }
+    if (tcp_raw_send(es->pcb, es) < 0) {
+        return;
+    }
+    tcp_raw_half_close(es);
 }
 
 static void
@@ -104,11 +688,9 @@ tcp_raw_error(void *arg, err_t err) {
 
     if (es != NULL) {
         printf("tcp_raw_error is %d %s\n", err, lwip_strerr(err));
-        if (es->pcb != NULL) {
-            tcp_raw_close(es->pcb, es);
-        } else {
-            tcp_raw_free(es);
-        }
+        /* lwip has already freed the pcb */
+        es->pcb = NULL;
+        tcp_raw_close(NULL, es);
     }
 }
 
@@ -119,15 +701,19 @@ tcp_raw_poll(void *arg, struct tcp_pcb *tpcb) {
 
     es = (struct tcp_raw_state *) arg;
     if (es != NULL) {
-        if (es->buf_used > 0) {
+        /* reads paused for lack of blocks have nothing in flight to resume them */
+        tcp_raw_read_resume(es);
+        /* neither watcher may be running to notice completions */
+        if (zerocopy_pending(&es->zc)) {
+            zerocopy_reap(&es->zc, es->socks_fd);
+        }
+        if (es->upq_len > 0) {
             /* there is a remaining pbuf (chain)  */
-            tcp_raw_send(tpcb, es);
-        } else {
-            /* no remaining pbuf (chain)  */
-            if (es->state == ES_CLOSING) {
-                tcp_raw_close(tpcb, es);
+            if (tcp_raw_send(tpcb, es) < 0) {
+                return ERR_OK;
             }
         }
+        tcp_raw_half_close(es);
         ret_err = ERR_OK;
     } else {
         /* nothing to be done */
@@ -141,21 +727,29 @@ static err_t
 tcp_raw_sent(void *arg, struct tcp_pcb *tpcb, u16_t len) {
     struct tcp_raw_state *es;
 
-    LWIP_UNUSED_ARG(len);
-
     es = (struct tcp_raw_state *) arg;
     es->retries = 0;
 
-    if (es->buf_used > 0) {
+    /* the acknowledged blocks are released, and there is sndbuf again */
+    tcp_raw_blocks_acked(&es->blk_head, len);
+    if (es->blk_head == NULL) {
+        es->blk_tail = NULL;
+    }
+    tcp_raw_blocks_trim(es);
+    if (es->pending > 0) {
+        send_data_lwip(tpcb, es);
+    }
+    tcp_raw_read_resume(es);
+
+    if (es->upq_len > 0) {
         /* still got pbufs to send */
         tcp_sent(tpcb, tcp_raw_sent);
-        tcp_raw_send(tpcb, es);
-    } else {
-        /* no more pbufs to send */
-        if (es->state == ES_CLOSING) {
-            tcp_raw_close(tpcb, es);
+        if (tcp_raw_send(tpcb, es) < 0) {
+            return ERR_OK;
         }
     }
+    /* pending may have drained, the server's FIN can follow */
+    tcp_raw_half_close(es);
     return ERR_OK;
 }
 
@@ -167,19 +761,13 @@ tcp_raw_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
     struct tcp_raw_state *es;
     err_t ret_err;
 
-    char buf[TCP_WND];
-
     LWIP_ASSERT("arg != NULL", arg != NULL);
     es = (struct tcp_raw_state *) arg;
     if (p == NULL) {
-        /* remote host closed connection */
+        /* the client is done sending, the download goes on until the server is too */
         es->state = ES_CLOSING;
-        if (es->buf_used <= 0) {
-            /* we're done sending, close it */
-            tcp_raw_close(tpcb, es);
-        } else {
-            /* we're not done yet */
-            tcp_raw_send(tpcb, es);
+        if (tcp_raw_send(tpcb, es) == 0) {
+            tcp_raw_half_close(es);
         }
         ret_err = ERR_OK;
     } else if (err != ERR_OK) {
@@ -193,24 +781,17 @@ tcp_raw_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
     } else if (es->state == ES_ACCEPTED) {
         /* first data chunk in p->payload */
         es->state = ES_RECEIVED;
+        tcp_raw_touch(es);
 
-        pbuf_copy_partial(p, buf, p->tot_len, 0);
-
-        std::string buf_cpp(buf, p->tot_len);
-        es->buf.append(buf_cpp);
-        es->buf_used += p->tot_len;
-
+        tcp_raw_upq_append(es, p);
         tcp_raw_send(tpcb, es);
         ret_err = ERR_OK;
     } else if (es->state == ES_RECEIVED) {
         /* read some more data */
-        pbuf_copy_partial(p, buf, p->tot_len, 0);
+        tcp_raw_touch(es);
 
-        std::string buf_cpp(buf, p->tot_len);
-        es->buf.append(buf_cpp);
-        es->buf_used += p->tot_len;
+        tcp_raw_upq_append(es, p);
         tcp_raw_send(tpcb, es);
-
         ret_err = ERR_OK;
     } else {
         /* unkown es->state, trash data  */
@@ -224,9 +805,7 @@ tcp_raw_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
 }
 
 static void free_all(struct ev_loop *loop, ev_io *watcher, struct tcp_raw_state *es, struct tcp_pcb *pcb) {
-    close(watcher->fd);
-    ev_io_stop(EV_DEFAULT, watcher);
-    es->socks_fd = 0;
+    /* tcp_raw_close stops watcher and closes socks_fd, or the pending handshake */
     tcp_raw_close(pcb, es);
 }
 
@@ -239,21 +818,19 @@ static void send_data_lwip(struct tcp_pcb *pcb, struct tcp_raw_state *es) {
 
         /* We cannot send more data than space available in the send buffer. */
         if (pcb->state != 0) {
-            if (tcp_sndbuf(pcb) < es->socks_buf_used) {
-                len = tcp_sndbuf(pcb);
-            } else {
-                len = es->socks_buf_used;
-            }
-
-            // 发送缓冲区满
-            if (tcp_sndbuf(pcb) == 0) {
-                // FIXME
-                // return;
-            }
+            for (tcp_raw_block *b = es->blk_head; b != NULL && es->pending > 0; b = b->next) {
+                if (b->queued == b->fill) {
+                    continue;
+                }
+                len = (u16_t) LWIP_MIN(b->fill - b->queued, (u32_t) tcp_sndbuf(pcb));
+                if (len == 0) {
+                    // 发送缓冲区满
+                    break;
+                }
 
-            if (len > 0) {
                 do {
-                    err = tcp_write(pcb, es->socks_buf.c_str(), len, TCP_WRITE_FLAG_COPY);
+                    /* no copy, the block stays referenced until tcp_raw_sent reports it acked */
+                    err = tcp_write(pcb, b->data + b->queued, len, 0);
 
                     if (err == ERR_MEM) {
                         if ((tcp_sndbuf(pcb) == 0) || (tcp_sndqueuelen(pcb) >= TCP_SND_QUEUELEN)) {
@@ -266,24 +843,31 @@ static void send_data_lwip(struct tcp_pcb *pcb, struct tcp_raw_state *es) {
                     }
                 } while (err == ERR_MEM && len > 1);
 
-                if (err == ERR_OK) {
-                    if (es->socks_buf.size() == len) {
-                        es->socks_buf.clear();
-                    } else {
-                        es->socks_buf.erase(es->socks_buf.begin(), es->socks_buf.end() - (es->socks_buf.size() - len));
-                    }
-                    es->socks_buf_used -= len;
-
-                    err_t wr_err = tcp_output(pcb);
-                    if (wr_err != ERR_OK) {
-                        printf("<---------------------------------- tcp_output wr_wrr is %s\n", lwip_strerr(wr_err));
-                    } else {
-                        if (es->lwip_blocked) {
-                            es->lwip_blocked = 0;
-                        }
-                    }
-                } else {
+                if (err != ERR_OK) {
                     printf("send_data_lwip: error %s len %d %d\n", lwip_strerr(err), len, tcp_sndbuf(pcb));
+                    break;
+                }
+
+                if (b->acked == b->queued) {
+                    /* lwip's reference, while any of it is unacknowledged */
+                    b->ref++;
+                }
+                b->queued += len;
+                es->pending -= len;
+                if (es->mux != NULL) {
+                    /* like reading that much more from socks_fd */
+                    mux_stream_consumed(es->mux, len);
+                }
+                relay_stats.download_bytes += len;
+                if (b->relay_ref && b->queued == b->size) {
+                    b->relay_ref = 0;
+                    tcp_raw_block_put(&es->blk_head, b);
+                }
+
+                /* tcp_output is deferred to the end of this loop iteration */
+                tcp_raw_mark_dirty(es);
+                if (b->queued < b->fill) {
+                    break;
                 }
             }
         }
@@ -295,70 +879,318 @@ static void write_and_output(struct tcp_pcb *pcb, struct tcp_raw_state *es) {
 }
 
 static void
-timeout_cb(struct ev_loop *loop, ev_timer *watcher, int revents) {
-    timer_ctx *timeout_ctx = container_of(watcher, timer_ctx, watcher);
-    struct tcp_raw_state *es = timeout_ctx->raw_state;
+timeout_cb(timer_wheel_node *node) {
+    struct tcp_raw_state *es = container_of(node, struct tcp_raw_state, idle);
     write_and_output(es->pcb, es);
     printf("timeout, clean\n");
-    free_all(loop, &(es->io), es, es->pcb);
+    free_all(EV_DEFAULT, &(es->io), es, es->pcb);
 }
 
+/**
+ * Stop reading socks_fd while lwip cannot take more, the data stays in the
+ * socket buffer and the server's window closes. tcp_raw_read_resume restarts it.
+ */
 static void
-block_cb(struct ev_loop *loop, ev_timer *watcher, int revents) {
-    timer_ctx *block_ctx = container_of(watcher, timer_ctx, watcher);
-    struct tcp_raw_state *es = block_ctx->raw_state;
-    write_and_output(es->pcb, es);
-    es->lwip_blocked = 0;
-    printf("Reset lwip block\n");
-    ev_timer_stop(EV_DEFAULT, watcher);
+tcp_raw_read_pause(struct tcp_raw_state *es) {
+    if (!es->read_paused) {
+        es->read_paused = 1;
+        ev_io_stop(EV_DEFAULT, &(es->io));
+        relay_stats.download_read_paused++;
+    }
 }
 
+static void
+tcp_raw_read_resume(struct tcp_raw_state *es) {
+    if (es->read_paused && !es->down_eof && es->pcb != NULL && tcp_sndbuf(es->pcb) > 0 && es->pending < pending_max) {
+        es->read_paused = 0;
+        ev_io_start(EV_DEFAULT, &(es->io));
+    }
+}
 
 static void read_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
     struct tcp_raw_state *es = container_of(watcher, struct tcp_raw_state, io);
     struct tcp_pcb *pcb = es->pcb;
 
-    ev_timer_again(EV_A_ &(es->timeout_ctx->watcher));
+    /* completions on the error queue wake this watcher too */
+    if (zerocopy_pending(&es->zc)) {
+        zerocopy_reap(&es->zc, es->socks_fd);
+    }
+
+    /* read as much as lwip can take right now, then wait for tcp_raw_sent */
+    for (;;) {
+        u32_t room = tcp_sndbuf(pcb);
+        if (room == 0 || es->pending >= pending_max) {
+            tcp_raw_read_pause(es);
+            return;
+        }
 
-    if (es->socks_buf_used > BUFFER_SIZE) {
-        es->lwip_blocked = 1;
-        ev_timer_start(EV_DEFAULT, &(es->block_ctx->watcher));
+        /* straight into a block that tcp_write references, no intermediate copy */
+        tcp_raw_block *b = es->blk_tail;
+        if (b == NULL || b->fill == b->size) {
+            b = tcp_raw_block_new(1);
+            if (b == NULL) {
+                if (buffer_starved) {
+                    /* resumed from tcp_raw_flush_cb once the budget has room */
+                    es->budget_paused = 1;
+                } else {
+                    /* resumed from tcp_raw_sent or tcp_raw_poll */
+                    printf("read_cb: out of memory for relay blocks\n");
+                }
+                tcp_raw_read_pause(es);
+                return;
+            }
+            if (es->blk_tail != NULL) {
+                es->blk_tail->next = b;
+            } else {
+                es->blk_head = b;
+            }
+            es->blk_tail = b;
+        }
+
+        ssize_t nreads;
+        u32_t want = LWIP_MIN(LWIP_MIN(b->size - b->fill, room), pending_max - es->pending);
+
+        nreads = recv(watcher->fd, b->data + b->fill, want, 0);
+        if (nreads < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            /* a block taken for nothing */
+            tcp_raw_blocks_trim(es);
+            return;
+        }
+        if (nreads < 0) {
+            printf("<---------------------------------- read error [%d] force close!!!\n", errno);
+            free_all(loop, watcher, es, pcb);
+            return;
+        }
+
+        // EOF
+        if (0 == nreads) {
+            /* the server is done sending, the client gets its FIN after pending */
+            es->down_eof = 1;
+            ev_io_stop(EV_DEFAULT, &(es->io));
+            write_and_output(pcb, es);
+            tcp_raw_half_close(es);
+            return;
+        }
+
+        tcp_raw_touch(es);
+        es->up->bytes_down += nreads;
+
+        b->fill += nreads;
+        es->pending += nreads;
+
+        write_and_output(pcb, es);
+
+        if ((u32_t) nreads < want) {
+            /* socket drained */
+            return;
+        }
+    }
+}
+
+/**
+ * data from the mux stream, the counterpart of read_cb. The stream's credit
+ * bounds what is buffered here, it is only handed back once tcp_write took it.
+ */
+static void
+tcp_raw_mux_recv(void *arg, const char *buf, size_t len) {
+    struct tcp_raw_state *es = (struct tcp_raw_state *) arg;
+    struct tcp_pcb *pcb = es->pcb;
+
+    if (buf == NULL) {
+        /* FIN, like EOF on socks_fd */
+        es->down_eof = 1;
+        write_and_output(pcb, es);
+        tcp_raw_half_close(es);
         return;
     }
+    while (len > 0) {
+        tcp_raw_block *b = es->blk_tail;
+        if (b == NULL || b->fill == b->size) {
+            /* bounded by the stream's credit, counted against the budget but never refused */
+            b = tcp_raw_block_new(0);
+            if (b == NULL) {
+                printf("tcp_raw_mux_recv: out of memory for relay blocks\n");
+                tcp_raw_abort(es);
+                return;
+            }
+            if (es->blk_tail != NULL) {
+                es->blk_tail->next = b;
+            } else {
+                es->blk_head = b;
+            }
+            es->blk_tail = b;
+        }
+        u32_t n = (u32_t) LWIP_MIN((size_t) (b->size - b->fill), len);
+        memcpy(b->data + b->fill, buf, n);
+        b->fill += n;
+        es->pending += n;
+        buf += n;
+        len -= n;
+    }
+    tcp_raw_touch(es);
+    write_and_output(pcb, es);
+}
 
-    char buffer[BUFFER_SIZE];
-    ssize_t nreads;
+/**
+ * the mux stream has credit again, the counterpart of write_cb
+ */
+static void
+tcp_raw_mux_sent(void *arg) {
+    struct tcp_raw_state *es = (struct tcp_raw_state *) arg;
 
-    nreads = recv(watcher->fd, buffer, BUFFER_SIZE, 0);
-    if (nreads < 0) {
-        printf("<---------------------------------- read error [%d] force close!!!\n", errno);
-        free_all(loop, watcher, es, pcb);
+    if (tcp_raw_send(es->pcb, es) < 0) {
         return;
     }
+    tcp_raw_half_close(es);
+}
 
-    // EOF
-    if (0 == nreads) {
-        write_and_output(pcb, es);
-        free_all(loop, watcher, es, pcb);
+/**
+ * the target refused the connection or the mux session died
+ */
+static void
+tcp_raw_mux_err(void *arg) {
+    struct tcp_raw_state *es = (struct tcp_raw_state *) arg;
+
+    /* freed by the mux */
+    es->mux = NULL;
+    /* reset the client, like a refused connection */
+    tcp_raw_abort(es);
+}
+
+/**
+ * client data buffered while the socks handshake runs, to go out with a
+ * pipelined request
+ */
+static size_t
+socks_early_cb(socks5_handshake *hs, u_char *buf, size_t max) {
+    struct tcp_raw_state *es = (struct tcp_raw_state *) hs->data;
+    if (es->hedge_up != NULL) {
+        /* another attempt is running, the client's bytes must reach the target once */
+        return 0;
+    }
+    if (es->upq == NULL || es->upq_len == 0) {
+        /* the client has sent nothing yet, the usual case */
+        return 0;
+    }
+    return pbuf_copy_partial(es->upq, buf, (u16_t) LWIP_MIN(max, (size_t) es->upq_len), es->upq_off);
+}
+
+/**
+ * socks handshake of a relay finished, start relaying in both directions
+ */
+static void
+socks_connected_cb(socks5_handshake *hs, int ok) {
+    struct tcp_raw_state *es = (struct tcp_raw_state *) hs->data;
+    u8_t which = hs == &es->hedge ? RACE_HEDGE : RACE_PRIMARY;
+    upstream *up = which == RACE_HEDGE ? es->hedge_up : es->up;
+
+    es->racing &= ~which;
+
+    if (!ok) {
+        /* a refused target says nothing about the server */
+        if (hs->rep == 0) {
+            upstream_failed(up);
+        }
+        if (which == RACE_HEDGE) {
+            upstream_release(es->hedge_up);
+            es->hedge_up = NULL;
+        }
+        if (es->racing) {
+            /* the other attempt may still make it */
+            return;
+        }
+        printf("socks5 handshake failed\n");
+        /* reset the client, like a refused connection */
+        tcp_raw_abort(es);
         return;
     }
 
-    std::string buf_cpp(buffer, nreads);
-    es->socks_buf.append(buf_cpp);
-    es->socks_buf_used += nreads;
+    timer_wheel_cancel(&es->hedge_timer);
+    upstream_latency(up, sys_clock_now() - hs->started);
+    if (which == RACE_HEDGE) {
+        relay_stats.socks_hedge_won++;
+        if (es->racing & RACE_PRIMARY) {
+            /* what the primary would still have taken, going by its server's usual handshake time */
+            u32_t primary_ms = sys_clock_now() - es->hs.started;
+            u32_t expected_ms = es->up->latency_ms8 / 8;
+            relay_stats.socks_hedge_measured++;
+            relay_stats.socks_hedge_saved_ms += expected_ms > primary_ms ? expected_ms - primary_ms : 0;
+            socks5_handshake_abort(&es->hs);
+            es->racing &= ~RACE_PRIMARY;
+        } else {
+            relay_stats.socks_hedge_rescued++;
+        }
+        /* the relay goes through the winner */
+        upstream_release(es->up);
+        es->up = up;
+        es->hedge_up = NULL;
+    } else if (es->racing & RACE_HEDGE) {
+        relay_stats.socks_hedge_lost++;
+        socks5_handshake_abort(&es->hedge);
+        es->racing &= ~RACE_HEDGE;
+        upstream_release(es->hedge_up);
+        es->hedge_up = NULL;
+    }
 
-    if (es->socks_buf_used > nreads) {
-        std::cout << "recv " << nreads << " data, " << "es->socks_buf_used is " << es->socks_buf_used
-                  << ", (tcp_sndbuf(pcb) is " << tcp_sndbuf(pcb) << std::endl;
+    if (hs->early_len > 0) {
+        /* sent along with the pipelined request, see socks_early_cb */
+        tcp_raw_upq_consume(es, (u32_t) hs->early_len);
+        tcp_raw_recved(es->pcb, (u32_t) hs->early_len);
     }
 
-    write_and_output(pcb, es);
+    es->socks_connected = 1;
+    es->socks_fd = hs->fd;
+    zerocopy_enable(&es->zc, es->socks_fd);
+    sock_tune_start(&es->tune, es->socks_fd);
+    ev_io_init(&(es->io), read_cb, es->socks_fd, EV_READ);
+    ev_io_start(EV_DEFAULT, &(es->io));
+    ev_io_init(&(es->wio), write_cb, es->socks_fd, EV_WRITE);
+
+    if (es->upq_len > 0) {
+        /* data the client sent during the handshake */
+        if (tcp_raw_send(es->pcb, es) < 0) {
+            return;
+        }
+    }
+    /* the client may have sent its FIN during the handshake */
+    tcp_raw_half_close(es);
+}
+
+/**
+ * the socks handshake of es is still running after socks_hedge_delay, race
+ * a second one against it
+ */
+static void
+tcp_raw_hedge_cb(timer_wheel_node *node) {
+    struct tcp_raw_state *es = container_of(node, tcp_raw_state, hedge_timer);
+    char localip_str[INET_ADDRSTRLEN];
+    char port[8];
+
+    if (es->hs.early_len > 0) {
+        /* the client's first bytes went out with the request, a second attempt would replay them */
+        relay_stats.socks_hedge_skipped++;
+        return;
+    }
+    inet_ntop(AF_INET, &(es->pcb->local_ip), localip_str, INET_ADDRSTRLEN);
+    sprintf(port, "%d", es->pcb->local_port);
+
+    es->hedge_up = upstream_pick_hedge(es->up);
+    /* no first payload, the winner sends it once relaying starts */
+    if (socks_pool_handshake(es->hedge_up, &es->hedge, localip_str, port, SOCKS5_CMD_CONNECT, 1,
+                             socks_connected_cb, NULL, es) < 0) {
+        upstream_failed(es->hedge_up);
+        upstream_release(es->hedge_up);
+        es->hedge_up = NULL;
+        return;
+    }
+    es->racing |= RACE_HEDGE;
+    relay_stats.socks_hedges++;
 }
 
 static err_t
 tcp_raw_accept(void *arg, struct tcp_pcb *newpcb, err_t err) {
-    err_t ret_err;
     struct tcp_raw_state *es;
+    int evict;
 
     LWIP_UNUSED_ARG(arg);
     if ((err != ERR_OK) || (newpcb == NULL)) {
@@ -370,6 +1202,10 @@ tcp_raw_accept(void *arg, struct tcp_pcb *newpcb, err_t err) {
        new pcbs of higher priority. */
     tcp_setprio(newpcb, TCP_PRIO_MIN);
 
+    if (!tcp_raw_admit(&evict)) {
+        return ERR_MEM;
+    }
+
     /**
      * local ip local port <-> remote ip remote port
      */
@@ -381,87 +1217,119 @@ tcp_raw_accept(void *arg, struct tcp_pcb *newpcb, err_t err) {
     // flow 119.23.211.95:80 <-> 172.16.0.1:53536
     // printf("<--------------------- tcp flow %s:%d <-> %s:%d\n", localip_str, newpcb->local_port, remoteip_str, newpcb->remote_port);
 
-    /**
-     * socks 5
-     */
-    int socks_fd = 0;
-
-    socks_fd = socks5_connect(conf->socks_server, conf->socks_port);
-    if (socks_fd < 1) {
-        printf("socks5 connect failed\n");
-        return -1;
-    }
-
     char port[64];
     sprintf(port, "%d", newpcb->local_port);
 
-    int ret = socks5_auth(socks_fd, localip_str, port, 0x01, 1);
-    if (ret < 0) {
-        printf("socks5 auth error\n");
-        return -1;
+    es = state_pool.alloc();
+    if (es == NULL) {
+        printf("tcp_raw_accept: out of memory for tcp_raw_state\n");
+        return ERR_MEM;
     }
 
-    es = (tcp_raw_state *) malloc(sizeof(tcp_raw_state));
-    memset(es, 0, sizeof(tcp_raw_state));
-
-    es->block_ctx = (timer_ctx *) malloc(sizeof(timer_ctx));
-    memset(es->block_ctx, 0, sizeof(timer_ctx));
-    es->block_ctx->raw_state = es;
+    /* allocated up front, closing a relay must not fail for lack of memory */
+    es->linger = linger_pool.alloc();
+    if (es->linger == NULL) {
+        printf("tcp_raw_accept: out of memory for tcp_raw_linger\n");
+        state_pool.release(es);
+        return ERR_MEM;
+    }
 
-    es->timeout_ctx = (timer_ctx *) malloc(sizeof(timer_ctx));
-    memset(es->timeout_ctx, 0, sizeof(timer_ctx));
-    es->timeout_ctx->raw_state = es;
+    /**
+     * a stream of a mux session when one is up, no handshake of its own
+     */
+    es->mux = mux_stream_open(ip4_addr_get_u32(&newpcb->local_ip), newpcb->local_port, es,
+                              tcp_raw_mux_recv, tcp_raw_mux_sent, tcp_raw_mux_err);
 
-    if (es != NULL) {
-        es->state = ES_ACCEPTED;
-        es->pcb = newpcb;
-        es->retries = 0;
+    /**
+     * socks 5, the handshake runs from the event loop, see socks_connected_cb
+     */
+    if (es->mux == NULL) {
+        es->up = upstream_pick(ip4_addr_get_u32(&newpcb->local_ip));
+        if (socks_pool_handshake(es->up, &es->hs, localip_str, port, SOCKS5_CMD_CONNECT, 1, socks_connected_cb, socks_early_cb, es) < 0) {
+            printf("socks5 connect failed\n");
+            upstream_failed(es->up);
+            upstream_release(es->up);
+            linger_pool.release(es->linger);
+            state_pool.release(es);
+            return ERR_MEM;
+        }
+    }
 
-        es->buf_used = 0;
-        es->socks_buf_used = 0;
-        es->lwip_blocked = 0;
+    if (evict) {
+        /* only now that the new relay cannot fail any more */
+        tcp_raw_evict();
+    }
 
-        es->socks_fd = socks_fd;
+    es->state = ES_ACCEPTED;
+    es->pcb = newpcb;
+    es->retries = 0;
 
+    es->read_paused = 0;
 
-        ev_timer_init(&(es->timeout_ctx->watcher), timeout_cb, timeout, 0.);
-        ev_timer_start(EV_DEFAULT, &(es->timeout_ctx->watcher));
+    es->socks_fd = 0;
+    /* a mux stream takes data right away, the server buffers it until connected */
+    es->socks_connected = es->mux != NULL;
+    if (es->mux == NULL) {
+        es->racing = RACE_PRIMARY;
+        if (hedge_delay > 0) {
+            timer_wheel_arm(&es->hedge_timer, hedge_delay, tcp_raw_hedge_cb);
+        }
+    }
 
-        ev_timer_init(&(es->block_ctx->watcher), block_cb, 0.1, 0.);
+    tcp_raw_lru_link(es);
+    tcp_raw_touch(es);
+    relay_stats.relay_live++;
+    if (relay_stats.relay_live > relay_stats.relay_peak) {
+        relay_stats.relay_peak = relay_stats.relay_live;
+    }
 
-        ev_io_init(&(es->io), read_cb, socks_fd, EV_READ);
-        ev_io_start(EV_DEFAULT, &(es->io));
 
-        /**
-         * enable tcp keepalive
-         */
-        newpcb->so_options |= SOF_KEEPALIVE;
-        newpcb->so_options |= SOF_REUSEADDR;
-        newpcb->keep_intvl = 75000; /* 75 seconds */
-
-        /* pass newly allocated es to our callbacks */
-        tcp_arg(newpcb, es);
-        tcp_recv(newpcb, tcp_raw_recv);
-        tcp_err(newpcb, tcp_raw_error);
-        tcp_poll(newpcb, tcp_raw_poll, 4);
-        tcp_sent(newpcb, tcp_raw_sent);
-        ret_err = ERR_OK;
-    } else {
-        ret_err = ERR_MEM;
-    }
-    return ret_err;
+    /**
+     * enable tcp keepalive
+     */
+    newpcb->so_options |= SOF_KEEPALIVE;
+    newpcb->so_options |= SOF_REUSEADDR;
+    newpcb->keep_intvl = 75000; /* 75 seconds */
+
+    /* pass newly allocated es to our callbacks */
+    tcp_arg(newpcb, es);
+    tcp_recv(newpcb, tcp_raw_recv);
+    tcp_err(newpcb, tcp_raw_error);
+    tcp_poll(newpcb, tcp_raw_poll, 4);
+    tcp_sent(newpcb, tcp_raw_sent);
+    return ERR_OK;
 }
 
 void
 tcp_raw_init(void) {
+    relay_capacity = (u32_t) conf_int(conf->max_connections, MEMP_NUM_TCP_PCB);
+    relay_stats.relay_capacity = relay_capacity;
+    evict_min_idle = (u32_t) conf_int(conf->relay_evict_min_idle, 30) * 1000;
+
+    pending_max = (u32_t) conf_int(conf->relay_buffer_size, 16384);
+    buffer_budget = (u32_t) conf_int(conf->relay_buffer_max_bytes, 32 * 1024 * 1024);
+    buffer_high = buffer_budget - buffer_budget / 8;
+    buffer_low = buffer_budget - buffer_budget / 4;
+    relay_stats.buffer_budget = buffer_budget;
+    idle_timeout = (u32_t) conf_int(conf->relay_idle_timeout, 300) * 1000;
+    hedge_delay = (u32_t) conf_int(conf->socks_hedge_delay, 0);
+
     tcp_raw_pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
     if (tcp_raw_pcb != NULL) {
         err_t err;
 
         err = tcp_bind(tcp_raw_pcb, IP_ANY_TYPE, 0);
         if (err == ERR_OK) {
-            tcp_raw_pcb = tcp_listen(tcp_raw_pcb);
+            /* bound the number of half open (SYN_RCVD) pcbs */
+            tcp_raw_pcb = tcp_listen_with_backlog(tcp_raw_pcb, (u8_t) LWIP_MIN(conf_int(conf->syn_backlog, 128), 0xff));
             tcp_accept(tcp_raw_pcb, tcp_raw_accept);
+
+            ev_check_init(&flush_watcher, tcp_raw_flush_cb);
+            ev_set_priority(&flush_watcher, EV_MINPRI);
+            ev_check_start(EV_DEFAULT, &flush_watcher);
+
+            tcp_ooseq_init();
+            socks5_handshake_init();
         } else {
             /* abort? output diagnostic? */
         }
@@ -470,4 +1338,140 @@ tcp_raw_init(void) {
     }
 }
 
+/**
+ * @return 1 when a new SYN would exceed the listener's SYN backlog
+ */
+int
+tcp_raw_backlog_full(void) {
+    struct tcp_pcb_listen *lpcb = (struct tcp_pcb_listen *) tcp_raw_pcb;
+    if (lpcb == NULL) {
+        return 0;
+    }
+    return lpcb->accepts_pending >= lpcb->backlog;
+}
+
+/**
+ * @return the relay owning pcb, NULL if pcb is not (or no longer) a relay
+ */
+struct tcp_raw_state *
+tcp_raw_state_of(struct tcp_pcb *pcb) {
+    if (pcb->recv != tcp_raw_recv) {
+        return NULL;
+    }
+    return (struct tcp_raw_state *) pcb->callback_arg;
+}
+
+/* relays listed by tcp_raw_display */
+#define TCP_RAW_DISPLAY_MAX 32
+
+void
+tcp_raw_display(void) {
+    int n = 0;
+
+    printf("\nRELAY TCP UPSTREAM (most recently active first)\n");
+    for (struct tcp_raw_state *es = lru_head; es != NULL && n < TCP_RAW_DISPLAY_MAX; es = es->lru_next, n++) {
+        const sock_tune *st = &es->tune;
+        char ip[INET_ADDRSTRLEN] = "-";
+        if (es->pcb != NULL) {
+            inet_ntop(AF_INET, &(es->pcb->local_ip), ip, INET_ADDRSTRLEN);
+        }
+        printf("\t%s:%d rtt %.2f ms, cwnd %u, tx %.1f KB/s, rx %.1f KB/s, sndbuf %u, rcvbuf %u, nodelay %d\n",
+               ip, es->pcb != NULL ? es->pcb->local_port : 0,
+               st->rtt_us / 1000., st->cwnd, st->tx_rate / 1024., st->rx_rate / 1024., st->sndbuf, st->rcvbuf,
+               st->nodelay);
+    }
+    if (n == 0) {
+        printf("\tnone\n");
+    }
+}
+
+/**
+ * @param reserved pcbs already taken for the relay being admitted
+ */
+static int
+tcp_raw_pcb_pool_full(int reserved) {
+#if MEMP_POOL_MODE && MEMP_STATS
+    struct stats_mem *pcbs = lwip_stats.memp[MEMP_TCP_PCB];
+    /* tcp_alloc reclaims TIME-WAIT pcbs by itself */
+    return pcbs->used - reserved >= pcbs->avail && tcp_tw_pcbs == NULL;
+#else
+    LWIP_UNUSED_ARG(reserved);
+    return 0;
+#endif
+}
+
+/**
+ * @return the least recently active relay if it has been idle for
+ * relay_evict_min_idle, NULL if no relay may be closed for a new one
+ */
+static struct tcp_raw_state *
+tcp_raw_evictable(void) {
+    if (lru_tail == NULL || sys_clock_now() - lru_tail->last_active < evict_min_idle) {
+        return NULL;
+    }
+    return lru_tail;
+}
+
+/**
+ * Whether a SYN may go on to lwip. Nothing is closed here, the SYN may be
+ * a retransmit or never complete the handshake. With the pcb pool full
+ * tcp_alloc makes room itself, closing the pcb inactive the longest, so
+ * only let it when a relay is idle enough to lose.
+ *
+ * @return 1 if a relay for a new connection could be admitted
+ */
+int
+tcp_raw_can_admit(void) {
+    int over_budget = buffer_budget > 0 && relay_stats.buffer_bytes > buffer_high;
+    if (!over_budget && relay_stats.relay_live < relay_capacity && !tcp_raw_pcb_pool_full(0)) {
+        return 1;
+    }
+    return tcp_raw_evictable() != NULL;
+}
+
+/**
+ * Admit the relay of a completed handshake, newpcb is already taken from
+ * the pool. When max_connections relays are live the least recently
+ * active relay is to be closed (pcb and socks_fd) instead of letting the
+ * new flow fail, if it has been idle for relay_evict_min_idle. The same
+ * goes above the high watermark of relay_buffer_max_bytes: the new relay
+ * holds nothing yet and reads keep to the budget, but without an idle
+ * relay to close it is refused.
+ *
+ * @param evict set when tcp_raw_evict must make room, once the new relay is set up
+ * @return 1 if a new relay can be admitted
+ */
+static int
+tcp_raw_admit(int *evict) {
+    int over_budget = buffer_budget > 0 && relay_stats.buffer_bytes > buffer_high;
+    *evict = 0;
+    if (!over_budget && relay_stats.relay_live < relay_capacity && !tcp_raw_pcb_pool_full(1)) {
+        return 1;
+    }
+    if (tcp_raw_evictable() == NULL) {
+        if (over_budget) {
+            relay_stats.relay_refused_budget++;
+        } else {
+            relay_stats.relay_refused++;
+        }
+        return 0;
+    }
+    *evict = 1;
+    return 1;
+}
+
+/**
+ * close the relay idle the longest for one admitted by tcp_raw_admit
+ */
+static void
+tcp_raw_evict(void) {
+    struct tcp_raw_state *victim = tcp_raw_evictable();
+    if (victim == NULL) {
+        return;
+    }
+    printf("evict relay idle for %.1fs\n", (sys_clock_now() - victim->last_active) / 1000.);
+    relay_stats.relay_evicted++;
+    tcp_raw_abort(victim);
+}
+
 #endif /* LWIP_TCP && LWIP_CALLBACK_API */
@@ -7,6 +7,14 @@
 #include "lwip/ip6.h"
 #include "ev.h"
 
+#include "sys_clock.h"
+#include "socks5.h"
+#include "timer_wheel.h"
+#include "zerocopy.h"
+#include "sock_tune.h"
+#include "upstream.h"
+#include "mux.h"
+
 enum tcp_raw_states {
     ES_NONE = 0,
     ES_ACCEPTED,
@@ -14,26 +22,103 @@ enum tcp_raw_states {
     ES_CLOSING
 };
 
-typedef struct timer_ctx {
-    ev_timer watcher;
-    struct tcp_raw_state *raw_state;
-} timer_ctx;
+/* download buffers, filled by recv and tcp_write without TCP_WRITE_FLAG_COPY */
+#define TCP_RAW_BLOCK_SIZE 16384
+
+/**
+ * One reference is the relay's, until the block is full and all queued to
+ * lwip, one is lwip's, while any queued byte is unacknowledged.
+ */
+typedef struct tcp_raw_block {
+    struct tcp_raw_block *next;
+    u32_t size;
+    u32_t fill;   /* received from socks_fd */
+    u32_t queued; /* passed to tcp_write */
+    u32_t acked;  /* acknowledged by the client */
+    u8_t ref;
+    u8_t relay_ref;
+    char data[0];
+} tcp_raw_block;
+
+/**
+ * tcp_arg of a closed pcb whose blocks are still being retransmitted
+ */
+typedef struct tcp_raw_linger {
+    struct tcp_raw_block *blocks;
+} tcp_raw_linger;
 
 typedef struct tcp_raw_state {
     ev_io io;
-    struct timer_ctx *timeout_ctx;
-    struct timer_ctx *block_ctx;
+    /* socks_fd writable, started while buf holds data the socket refused */
+    ev_io wio;
+    /* idle deadline, pushed back by tcp_raw_touch */
+    timer_wheel_node idle;
     u8_t state;
     u8_t retries;
+    /* half close: the client's FIN passed on to the server, the server's
+       EOF seen and its FIN queued to the client, see tcp_raw_half_close */
+    u8_t up_shut;
+    u8_t down_eof;
+    u8_t down_shut;
     struct tcp_pcb *pcb;
     int socks_fd;
-    std::string buf;
-    u16_t buf_used;
-    std::string socks_buf;
-    u16_t socks_buf_used;
-    int lwip_blocked;
+    /* socks server the relay was placed on */
+    upstream *up;
+    /* carries the relay instead of socks_fd when a mux session was up, see mux_init */
+    mux_stream *mux;
+    /* socks handshake for this relay, socks_fd is set once it succeeded */
+    socks5_handshake hs;
+    int socks_connected;
+    /* second handshake raced against hs after socks_hedge_delay, see tcp_raw_hedge_cb */
+    socks5_handshake hedge;
+    timer_wheel_node hedge_timer;
+    /* server of the hedge while it runs */
+    upstream *hedge_up;
+    /* handshakes still running, RACE_PRIMARY and RACE_HEDGE */
+    u8_t racing;
+    /* client pbufs waiting for socks_fd, upq_off bytes of the first are sent */
+    struct pbuf *upq;
+    struct pbuf *upq_last;
+    u16_t upq_off;
+    u32_t upq_len;
+    /* MSG_ZEROCOPY sends to socks_fd whose pbufs the kernel still reads */
+    zerocopy_state zc;
+    /* TCP_INFO samples and buffer sizes of socks_fd */
+    sock_tune tune;
+    /* socks_fd data, from the oldest block lwip still holds to the one being filled */
+    struct tcp_raw_block *blk_head;
+    struct tcp_raw_block *blk_tail;
+    /* received and not yet tcp_write */
+    u32_t pending;
+    /* takes over blk_head when the pcb is closed with data in flight */
+    struct tcp_raw_linger *linger;
+    /* io stopped until lwip has sndbuf again, see tcp_raw_read_pause */
+    int read_paused;
+    /* read_paused for relay_buffer_max_bytes, resumed by tcp_raw_budget_resume */
+    u8_t budget_paused;
+    /* queued with tcp_write, waiting for tcp_raw_flush_cb to tcp_output */
+    u8_t dirty;
+    struct tcp_raw_state *dirty_prev;
+    struct tcp_raw_state *dirty_next;
+    /* idle LRU of all relays, most recently active first */
+    u32_t last_active;
+    struct tcp_raw_state *lru_prev;
+    struct tcp_raw_state *lru_next;
+    /* when the pcb's ooseq was first seen non empty, see tcp_ooseq_cb */
+    u32_t ooseq_since;
 } tcp_raw_state;
 
 void tcp_raw_init(void);
 
+int tcp_raw_backlog_full(void);
+
+int tcp_raw_can_admit(void);
+
+struct tcp_raw_state *tcp_raw_state_of(struct tcp_pcb *pcb);
+
+/**
+ * print the upstream samples of the most recently active relays
+ */
+void tcp_raw_display(void);
+
 #endif /* LWIP_TCP_RAW_H */
@@ -0,0 +1,192 @@
+#include "ev.h"
+
+#include "relay_stats.h"
+#include "sys_clock.h"
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/* each slot is the sentinel of a circular list */
+static timer_wheel_node wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+/* next tick to run */
+static u32_t current;
+
+/*
+ * Ticks since timer_wheel_init, advanced by the ms elapsed between reads
+ * so the wrap of the 32 bit ms clock after 49.7 days does not show:
+ * dividing the clock itself would jump back to tick 0 there.
+ */
+static u32_t ticks;
+static u32_t last_ms;
+/* ms elapsed since the current tick began */
+static u32_t carry_ms;
+
+static ev_timer tick_watcher;
+
+static u32_t
+timer_wheel_now(void) {
+    u32_t now = sys_clock_now();
+    u32_t elapsed = now - last_ms + carry_ms;
+
+    last_ms = now;
+    ticks += elapsed / TIMER_WHEEL_TICK_MS;
+    carry_ms = elapsed % TIMER_WHEEL_TICK_MS;
+    return ticks;
+}
+
+static void
+timer_wheel_link(timer_wheel_node *head, timer_wheel_node *node) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void
+timer_wheel_unlink(timer_wheel_node *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+static void
+timer_wheel_insert(timer_wheel_node *node) {
+    u32_t expires = node->expires;
+    s32_t delta = (s32_t) (expires - current);
+    int level;
+
+    if (delta < 0) {
+        /* already due, runs on the next tick */
+        expires = current;
+        delta = 0;
+    }
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+        if ((u32_t) delta < (1u << (TIMER_WHEEL_BITS * (level + 1)))) {
+            break;
+        }
+    }
+    if (level == TIMER_WHEEL_LEVELS - 1 && (u32_t) delta >= (1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))) {
+        /* beyond the top level, parked at its farthest slot and moved down from there */
+        expires = current + (1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    }
+    timer_wheel_link(&wheel[level][(expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK], node);
+}
+
+/**
+ * move the nodes of one upper level slot down to where they belong now
+ */
+static void
+timer_wheel_cascade(int level) {
+    timer_wheel_node *head = &wheel[level][(current >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+    timer_wheel_node list;
+
+    if (head->next == head) {
+        return;
+    }
+    /* splice out first, insert may put nodes back into this very slot */
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    head->next = head;
+    head->prev = head;
+
+    while (list.next != &list) {
+        timer_wheel_node *node = list.next;
+        timer_wheel_unlink(node);
+        timer_wheel_insert(node);
+    }
+}
+
+static void
+timer_wheel_run(u32_t tick) {
+    timer_wheel_node *head = &wheel[0][tick & TIMER_WHEEL_MASK];
+    timer_wheel_node list;
+
+    if (head->next == head) {
+        return;
+    }
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    head->next = head;
+    head->prev = head;
+
+    /* a callback may cancel or re-arm any node, including ones still in list */
+    while (list.next != &list) {
+        timer_wheel_node *node = list.next;
+        timer_wheel_unlink(node);
+        if ((s32_t) (node->expires - tick) > 0) {
+            /* pushed back since it was inserted */
+            timer_wheel_insert(node);
+            continue;
+        }
+        relay_stats.timers_fired++;
+        node->cb(node);
+    }
+}
+
+static void
+timer_wheel_tick_cb(struct ev_loop *loop, ev_timer *watcher, int revents) {
+    u32_t now = timer_wheel_now();
+
+    while ((s32_t) (now - current) >= 0) {
+        u32_t tick = current;
+        if ((tick & TIMER_WHEEL_MASK) == 0) {
+            for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+                timer_wheel_cascade(level);
+                if (((tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK) != 0) {
+                    break;
+                }
+            }
+        }
+        /* nodes armed by the callbacks are due on the next tick at the earliest */
+        current = tick + 1;
+        timer_wheel_run(tick);
+    }
+}
+
+void
+timer_wheel_init(void) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+            wheel[level][i].next = &wheel[level][i];
+            wheel[level][i].prev = &wheel[level][i];
+        }
+    }
+    last_ms = sys_clock_now();
+    current = timer_wheel_now();
+
+    ev_timer_init(&tick_watcher, timer_wheel_tick_cb, TIMER_WHEEL_TICK_MS / 1000., TIMER_WHEEL_TICK_MS / 1000.);
+    ev_timer_start(EV_DEFAULT, &tick_watcher);
+}
+
+void
+timer_wheel_arm(timer_wheel_node *node, u32_t ms, timer_wheel_cb cb) {
+    u32_t expires = timer_wheel_now();
+    /* rounded up, a deadline never fires early */
+    expires += (carry_ms + ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+
+    node->cb = cb;
+    if (timer_wheel_armed(node)) {
+        if ((s32_t) (expires - node->expires) >= 0) {
+            /* later: only remember it, see timer_wheel_run */
+            node->expires = expires;
+            return;
+        }
+        timer_wheel_unlink(node);
+    }
+    node->expires = expires;
+    timer_wheel_insert(node);
+    relay_stats.timers_armed++;
+}
+
+void
+timer_wheel_cancel(timer_wheel_node *node) {
+    if (timer_wheel_armed(node)) {
+        timer_wheel_unlink(node);
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef IP2SOCKS_TIMER_WHEEL_H
+#define IP2SOCKS_TIMER_WHEEL_H
+
+#include "lwip/arch.h"
+
+/* resolution of all relay deadlines */
+#define TIMER_WHEEL_TICK_MS 100
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+struct timer_wheel_node;
+
+typedef void (*timer_wheel_cb)(struct timer_wheel_node *node);
+
+/**
+ * Embedded in the object the deadline belongs to, recovered in cb with
+ * container_of. Zeroed memory is a valid unarmed node.
+ */
+typedef struct timer_wheel_node {
+    struct timer_wheel_node *prev;
+    struct timer_wheel_node *next;
+    /* deadline in ticks, may be later than the slot the node sits in */
+    u32_t expires;
+    timer_wheel_cb cb;
+} timer_wheel_node;
+
+/**
+ * Hierarchical timing wheel driven by one ev_timer, 4 levels of 64 slots:
+ * 6.4 s at tick resolution, then 7 min, 7 h and 19 days per revolution.
+ * Arm, re-arm and cancel are O(1), a node moves down one level at most
+ * three times before it fires.
+ */
+void timer_wheel_init(void);
+
+/**
+ * (re)arm node to call cb in ms milliseconds. Pushing an armed deadline
+ * later only stores it, the node is moved when its old slot comes up.
+ */
+void timer_wheel_arm(timer_wheel_node *node, u32_t ms, timer_wheel_cb cb);
+
+void timer_wheel_cancel(timer_wheel_node *node);
+
+static inline int timer_wheel_armed(const timer_wheel_node *node) {
+    return node->next != NULL;
+}
+
+#endif //IP2SOCKS_TIMER_WHEEL_H
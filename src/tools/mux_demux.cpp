@@ -0,0 +1,524 @@
+/**
+ * ip2socks-demux, the far end of mux_server: takes the multiplexed
+ * connections of ip2socks and connects every stream to its target.
+ * With -e streams are echoed back instead, to test and benchmark the
+ * transport without a network.
+ *
+ *   ip2socks-demux [-l 127.0.0.1:1081] [-e]
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ev.h"
+
+#include "mux_frame.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* frames queued to one session before targets are no longer read */
+#define DEMUX_SEND_BUFFER (1024 * 1024)
+#define DEMUX_RECV_BUFFER (2 * (MUX_HEADER_SIZE + MUX_FRAME_MAX))
+#define DEMUX_UPD_MIN (MUX_WINDOW / 4)
+
+#define container_of(ptr, type, member) ({      \
+  const typeof( ((type *)0)->member ) *__mptr = (ptr);  \
+  (type *)( (char *)__mptr - offsetof(type,member) );})
+
+struct demux_session;
+
+typedef struct demux_stream {
+    struct demux_session *s;
+    uint32_t sid;
+    int fd;
+    ev_io io;
+    ev_io wio;
+    int connected;
+    /* PSH payload we may still send to ip2socks */
+    uint32_t send_credit;
+    /* written to the target, not yet handed back with UPD */
+    uint32_t unreturned;
+    /* from ip2socks, not yet written to the target, from off */
+    std::string up;
+    size_t off;
+    int fin_received;
+    int fin_sent;
+} demux_stream;
+
+typedef struct demux_session {
+    ev_io io;
+    ev_io wio;
+    int fd;
+    std::unordered_map<uint32_t, demux_stream *> streams;
+    unsigned char *rbuf;
+    size_t rlen;
+    std::string out;
+    size_t out_off;
+} demux_session;
+
+static int echo;
+
+static void demux_stream_pump(demux_stream *st);
+
+static void demux_session_flush(demux_session *s);
+
+static int
+setnonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static size_t
+demux_queued(const demux_session *s) {
+    return s->out.size() - s->out_off;
+}
+
+static void
+demux_frame_out(demux_session *s, uint8_t cmd, uint32_t sid, const char *payload, uint16_t len) {
+    unsigned char h[MUX_HEADER_SIZE];
+    mux_header_put(h, cmd, len, sid);
+    if (s->out_off == s->out.size()) {
+        s->out.clear();
+        s->out_off = 0;
+    }
+    s->out.append((const char *) h, sizeof(h));
+    if (len > 0) {
+        s->out.append(payload, len);
+    }
+    ev_io_start(EV_DEFAULT, &s->wio);
+}
+
+static void
+demux_stream_free(demux_stream *st) {
+    if (st->fd >= 0) {
+        ev_io_stop(EV_DEFAULT, &st->io);
+        ev_io_stop(EV_DEFAULT, &st->wio);
+        close(st->fd);
+    }
+    st->s->streams.erase(st->sid);
+    delete st;
+}
+
+static void
+demux_stream_reset(demux_stream *st) {
+    demux_frame_out(st->s, MUX_RST, st->sid, NULL, 0);
+    demux_stream_free(st);
+}
+
+/**
+ * both directions are done
+ */
+static void
+demux_stream_check_done(demux_stream *st) {
+    if (st->fin_sent && st->fin_received && st->off == st->up.size()) {
+        demux_stream_free(st);
+    }
+}
+
+static void
+demux_session_close(demux_session *s) {
+    ev_io_stop(EV_DEFAULT, &s->io);
+    ev_io_stop(EV_DEFAULT, &s->wio);
+    close(s->fd);
+    std::vector<demux_stream *> streams;
+    for (auto &it : s->streams) {
+        streams.push_back(it.second);
+    }
+    for (size_t i = 0; i < streams.size(); i++) {
+        demux_stream_free(streams[i]);
+    }
+    free(s->rbuf);
+    delete s;
+}
+
+/**
+ * ip2socks may send n more bytes once the target took them
+ */
+static void
+demux_stream_consumed(demux_stream *st, size_t n) {
+    st->unreturned += n;
+    if (st->unreturned >= DEMUX_UPD_MIN) {
+        unsigned char credit[4];
+        mux_put32(credit, st->unreturned);
+        demux_frame_out(st->s, MUX_UPD, st->sid, (const char *) credit, sizeof(credit));
+        st->unreturned = 0;
+    }
+}
+
+/**
+ * target to ip2socks, as much as credit and the session buffer allow
+ */
+static void
+demux_stream_read_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
+    demux_stream *st = container_of(watcher, demux_stream, io);
+    char buf[MUX_FRAME_MAX];
+
+    for (;;) {
+        if (st->send_credit == 0 || demux_queued(st->s) >= DEMUX_SEND_BUFFER) {
+            /* resumed by UPD or once the session drained */
+            ev_io_stop(EV_DEFAULT, &st->io);
+            return;
+        }
+        size_t want = st->send_credit < sizeof(buf) ? st->send_credit : sizeof(buf);
+        ssize_t n = recv(st->fd, buf, want, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if (n < 0) {
+            demux_stream_reset(st);
+            return;
+        }
+        if (n == 0) {
+            ev_io_stop(EV_DEFAULT, &st->io);
+            demux_frame_out(st->s, MUX_FIN, st->sid, NULL, 0);
+            st->fin_sent = 1;
+            demux_stream_check_done(st);
+            return;
+        }
+        st->send_credit -= n;
+        demux_frame_out(st->s, MUX_PSH, st->sid, buf, (uint16_t) n);
+    }
+}
+
+static void
+demux_stream_write_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
+    demux_stream *st = container_of(watcher, demux_stream, wio);
+
+    if (!st->connected) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(st->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+            demux_stream_reset(st);
+            return;
+        }
+        st->connected = 1;
+        ev_io_start(EV_DEFAULT, &st->io);
+    }
+    demux_stream_pump(st);
+}
+
+/**
+ * ip2socks to the target, or back to ip2socks with -e
+ */
+static void
+demux_stream_pump(demux_stream *st) {
+    if (!st->connected) {
+        /* demux_stream_write_cb pumps once it is */
+        return;
+    }
+    while (st->off < st->up.size()) {
+        size_t len = st->up.size() - st->off;
+        ssize_t n;
+        if (echo) {
+            if (st->send_credit == 0 || demux_queued(st->s) >= DEMUX_SEND_BUFFER) {
+                return;
+            }
+            n = (ssize_t) (len < MUX_FRAME_MAX ? len : MUX_FRAME_MAX);
+            if ((size_t) n > st->send_credit) {
+                n = st->send_credit;
+            }
+            st->send_credit -= n;
+            demux_frame_out(st->s, MUX_PSH, st->sid, st->up.data() + st->off, (uint16_t) n);
+        } else {
+            n = send(st->fd, st->up.data() + st->off, len, MSG_NOSIGNAL);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                ev_io_start(EV_DEFAULT, &st->wio);
+                return;
+            }
+            if (n < 0) {
+                demux_stream_reset(st);
+                return;
+            }
+        }
+        st->off += n;
+        demux_stream_consumed(st, (size_t) n);
+    }
+    st->up.clear();
+    st->off = 0;
+    if (!echo) {
+        ev_io_stop(EV_DEFAULT, &st->wio);
+    }
+    if (st->fin_received) {
+        if (echo) {
+            if (!st->fin_sent) {
+                demux_frame_out(st->s, MUX_FIN, st->sid, NULL, 0);
+                st->fin_sent = 1;
+            }
+        } else {
+            shutdown(st->fd, SHUT_WR);
+        }
+        demux_stream_check_done(st);
+    }
+}
+
+/**
+ * connect to the socks 5 address of a SYN
+ *
+ * @return -1 if it cannot be reached
+ */
+static int
+demux_stream_connect(demux_stream *st, const unsigned char *addr, size_t len) {
+    struct sockaddr_storage ss;
+    socklen_t ss_len;
+
+    memset(&ss, 0, sizeof(ss));
+    if (len == 7 && addr[0] == 0x01) {
+        struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, addr + 1, 4);
+        memcpy(&sin->sin_port, addr + 5, 2);
+        ss_len = sizeof(*sin);
+    } else if (len >= 2 && addr[0] == 0x03 && len == (size_t) addr[1] + 4) {
+        /* a stand-in, resolving blocks the loop */
+        std::string host((const char *) addr + 2, addr[1]);
+        char port[8];
+        snprintf(port, sizeof(port), "%u", (addr[len - 2] << 8) | addr[len - 1]);
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(), port, &hints, &res) != 0) {
+            return -1;
+        }
+        memcpy(&ss, res->ai_addr, res->ai_addrlen);
+        ss_len = res->ai_addrlen;
+        freeaddrinfo(res);
+    } else {
+        return -1;
+    }
+
+    st->fd = socket(ss.ss_family, SOCK_STREAM, 0);
+    if (st->fd < 0) {
+        return -1;
+    }
+    setnonblocking(st->fd);
+    if (connect(st->fd, (struct sockaddr *) &ss, ss_len) < 0 && errno != EINPROGRESS) {
+        return -1;
+    }
+    ev_io_init(&st->io, demux_stream_read_cb, st->fd, EV_READ);
+    ev_io_init(&st->wio, demux_stream_write_cb, st->fd, EV_WRITE);
+    ev_io_start(EV_DEFAULT, &st->wio);
+    return 0;
+}
+
+static void
+demux_frame_in(demux_session *s, const mux_header *h, const unsigned char *payload) {
+    auto it = s->streams.find(h->sid);
+    demux_stream *st = it != s->streams.end() ? it->second : NULL;
+
+    if (h->cmd == MUX_SYN) {
+        if (st != NULL) {
+            return;
+        }
+        st = new demux_stream();
+        st->s = s;
+        st->sid = h->sid;
+        st->fd = -1;
+        st->send_credit = MUX_WINDOW;
+        st->connected = echo;
+        s->streams[h->sid] = st;
+        if (!echo && demux_stream_connect(st, payload, h->length) < 0) {
+            demux_stream_reset(st);
+        }
+        return;
+    }
+    if (st == NULL) {
+        if (h->cmd == MUX_PSH) {
+            demux_frame_out(s, MUX_RST, h->sid, NULL, 0);
+        }
+        return;
+    }
+    switch (h->cmd) {
+        case MUX_PSH:
+            if (st->up.size() - st->off + h->length > MUX_WINDOW) {
+                printf("stream %u sent past its credit, reset\n", st->sid);
+                demux_stream_reset(st);
+                return;
+            }
+            st->up.append((const char *) payload, h->length);
+            demux_stream_pump(st);
+            break;
+        case MUX_FIN:
+            st->fin_received = 1;
+            demux_stream_pump(st);
+            break;
+        case MUX_UPD:
+            if (h->length == 4) {
+                st->send_credit += mux_get32(payload);
+                if (echo) {
+                    demux_stream_pump(st);
+                } else if (st->connected && !st->fin_sent) {
+                    ev_io_start(EV_DEFAULT, &st->io);
+                }
+            }
+            break;
+        case MUX_RST:
+            demux_stream_free(st);
+            break;
+        default:
+            break;
+    }
+}
+
+static void
+demux_session_read_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
+    demux_session *s = container_of(watcher, demux_session, io);
+
+    ssize_t n = recv(s->fd, s->rbuf + s->rlen, DEMUX_RECV_BUFFER - s->rlen, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (n <= 0) {
+        demux_session_close(s);
+        return;
+    }
+    s->rlen += n;
+
+    size_t off = 0;
+    while (s->rlen - off >= MUX_HEADER_SIZE) {
+        mux_header h;
+        mux_header_get(s->rbuf + off, &h);
+        if (h.ver != MUX_VERSION) {
+            printf("bad frame version %u, closing the session\n", h.ver);
+            demux_session_close(s);
+            return;
+        }
+        if (s->rlen - off < MUX_HEADER_SIZE + (size_t) h.length) {
+            break;
+        }
+        demux_frame_in(s, &h, s->rbuf + off + MUX_HEADER_SIZE);
+        off += MUX_HEADER_SIZE + h.length;
+    }
+    memmove(s->rbuf, s->rbuf + off, s->rlen - off);
+    s->rlen -= off;
+}
+
+static void
+demux_session_flush(demux_session *s) {
+    int was_full = demux_queued(s) >= DEMUX_SEND_BUFFER;
+
+    while (demux_queued(s) > 0) {
+        ssize_t n = send(s->fd, s->out.data() + s->out_off, demux_queued(s), MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            break;
+        }
+        if (n < 0) {
+            demux_session_close(s);
+            return;
+        }
+        s->out_off += n;
+    }
+    if (demux_queued(s) == 0) {
+        s->out.clear();
+        s->out_off = 0;
+        ev_io_stop(EV_DEFAULT, &s->wio);
+    }
+    if (was_full && demux_queued(s) < DEMUX_SEND_BUFFER) {
+        /* streams that stopped for room go on */
+        std::vector<uint32_t> sids;
+        for (auto &it : s->streams) {
+            sids.push_back(it.first);
+        }
+        for (size_t i = 0; i < sids.size(); i++) {
+            auto it = s->streams.find(sids[i]);
+            if (it == s->streams.end()) {
+                continue;
+            }
+            demux_stream *st = it->second;
+            if (echo) {
+                demux_stream_pump(st);
+            } else if (st->connected && !st->fin_sent && st->send_credit > 0) {
+                ev_io_start(EV_DEFAULT, &st->io);
+            }
+        }
+    }
+}
+
+static void
+demux_session_write_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
+    demux_session *s = container_of(watcher, demux_session, wio);
+    demux_session_flush(s);
+}
+
+static void
+demux_accept_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
+    int fd = accept(watcher->fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setnonblocking(fd);
+
+    demux_session *s = new demux_session();
+    s->fd = fd;
+    s->rbuf = (unsigned char *) malloc(DEMUX_RECV_BUFFER);
+    ev_io_init(&s->io, demux_session_read_cb, fd, EV_READ);
+    ev_io_init(&s->wio, demux_session_write_cb, fd, EV_WRITE);
+    ev_io_start(EV_DEFAULT, &s->io);
+}
+
+int
+main(int argc, char **argv) {
+    const char *listen_addr = "127.0.0.1:1081";
+    int c;
+
+    while ((c = getopt(argc, argv, "l:eh")) != -1) {
+        switch (c) {
+            case 'l':
+                listen_addr = optarg;
+                break;
+            case 'e':
+                echo = 1;
+                break;
+            default:
+                printf("usage: %s [-l host:port] [-e]\n", argv[0]);
+                printf("\t-l\taddress to listen on, default 127.0.0.1:1081\n");
+                printf("\t-e\techo every stream back instead of connecting to its target\n");
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    const char *colon = strrchr(listen_addr, ':');
+    if (colon == NULL) {
+        printf("%s has no port\n", listen_addr);
+        return 1;
+    }
+    std::string host(listen_addr, colon - listen_addr);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(host.c_str());
+    addr.sin_port = htons(atoi(colon + 1));
+
+    signal(SIGPIPE, SIG_IGN);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+        printf("listen on %s failed: %s\n", listen_addr, strerror(errno));
+        return 1;
+    }
+    setnonblocking(fd);
+
+    ev_io accept_watcher;
+    ev_io_init(&accept_watcher, demux_accept_cb, fd, EV_READ);
+    ev_io_start(EV_DEFAULT, &accept_watcher);
+
+    printf("ip2socks-demux listening on %s%s\n", listen_addr, echo ? ", echo mode" : "");
+    return ev_run(EV_DEFAULT, 0);
+}
@@ -18,19 +18,21 @@
 #include "udp_raw.h"
 #include "struct.h"
 #include "socks5.h"
+#include "socks_pool.h"
+#include "timer_wheel.h"
+#include "object_pool.h"
+#include "upstream.h"
+#include "relay_stats.h"
 #include "util.h"
 #include "var.h"
 
 #if LWIP_UDP
 
-typedef struct udp_timer_ctx {
-    ev_timer watcher;
-    struct udp_raw_state *raw_state;
-} udp_timer_ctx;
-
 struct udp_raw_state {
     ev_io io;
-    struct udp_timer_ctx *timeout_ctx;
+    timer_wheel_node timeout;
+    /* socks server of the association or tcp dns query, NULL for direct dns */
+    upstream *up;
     int socks_tcp_fd; // just for udp relay via socks5
     u8_t state;
     u8_t retries;
@@ -42,25 +44,27 @@ struct udp_raw_state {
 };
 
 typedef struct {
-    char *buffer;
     ssize_t length;
+    char buffer[UDP_BUFFER_SIZE];
 } response;
 
-static ev_tstamp timeout = 60.;
+/* ms to wait for the answer */
+#define UDP_RAW_TIMEOUT 60000
 
 static struct udp_pcb *udp_raw_pcb;
 
+static object_pool<udp_raw_state> state_pool("udp_raw_state");
+static object_pool<response> response_pool("dns response");
+
 
 static void free_dns_query(ev_io *watcher, struct udp_raw_state *es) {
     // close socks dns socket
     close(watcher->fd);
     ev_io_stop(EV_DEFAULT, watcher);
 
-    if (es->timeout_ctx->watcher.active != ERR_OK) {
-        ev_timer_stop(EV_DEFAULT, &(es->timeout_ctx->watcher));
-    }
-    free(es->timeout_ctx);
-    free(es);
+    timer_wheel_cancel(&es->timeout);
+    upstream_release(es->up);
+    state_pool.release(es);
 }
 
 
@@ -81,11 +85,18 @@ static void udp_socks_relay_cb(EV_P_ ev_io *watcher, int revents) {
         return;
     }
 
-    ev_timer_again(EV_A_ &(es->timeout_ctx->watcher));
+    es->up->bytes_down += nread;
 
     /* send received packet back to sender */
     ssize_t data_len = nread - 10;
     struct pbuf *socksp = pbuf_alloc(PBUF_TRANSPORT, (uint16_t) data_len, PBUF_RAM);
+    if (socksp == NULL) {
+        /* the pools are exhausted, the datagram is lost like on the wire */
+        relay_stats.udp_dropped_nomem++;
+        close(es->socks_tcp_fd);
+        free_dns_query(watcher, es);
+        return;
+    }
     memcpy(socksp->payload, buff + 10, (size_t) data_len);
 
     struct in_addr ip;
@@ -119,10 +130,13 @@ static void dns_relay_cb(EV_P_ ev_io *watcher, int revents) {
         return;
     }
 
-    ev_timer_again(EV_A_ &(es->timeout_ctx->watcher));
-
     /* send received packet back to sender */
     struct pbuf *socksp = pbuf_alloc(PBUF_TRANSPORT, (uint16_t) nread, PBUF_RAM);
+    if (socksp == NULL) {
+        relay_stats.udp_dropped_nomem++;
+        free_dns_query(watcher, es);
+        return;
+    }
     memcpy(socksp->payload, buff, (size_t) nread);
 
     struct in_addr ip;
@@ -140,16 +154,17 @@ static void dns_relay_cb(EV_P_ ev_io *watcher, int revents) {
 
 static void tcp_dns_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
     struct udp_raw_state *es = container_of(watcher, struct udp_raw_state, io);
-    response *buffer = (response *) malloc(sizeof(response));
-    buffer->buffer = static_cast<char *>(malloc(UDP_BUFFER_SIZE));
+    response *buffer = response_pool.alloc();
+    if (buffer == NULL) {
+        printf("tcp_dns_cb: out of memory for dns response\n");
+        free_dns_query(watcher, es);
+        return;
+    }
     buffer->length = recv(watcher->fd, buffer->buffer, UDP_BUFFER_SIZE, 0);
 
-    ev_timer_again(EV_A_ &(es->timeout_ctx->watcher));
-
     if (buffer->length < 0) {
         printf("tcp dns query failed, len is %ld\n", buffer->length);
-        free(buffer->buffer);
-        free(buffer);
+        response_pool.release(buffer);
 
         free_dns_query(watcher, es);
         return;
@@ -157,15 +172,21 @@ static void tcp_dns_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
 
     if (buffer->length == 0) {
         printf("tcp dns query EOF\n");
-        free(buffer->buffer);
-        free(buffer);
+        response_pool.release(buffer);
 
         free_dns_query(watcher, es);
         return;
     }
 
     if (buffer->length > 0) {
+        es->up->bytes_down += buffer->length;
         struct pbuf *socksp = pbuf_alloc(PBUF_TRANSPORT, (uint16_t) buffer->length - 2, PBUF_RAM);
+        if (socksp == NULL) {
+            relay_stats.udp_dropped_nomem++;
+            response_pool.release(buffer);
+            free_dns_query(watcher, es);
+            return;
+        }
         memcpy(socksp->payload, buffer->buffer + 2, (size_t) buffer->length - 2);
 
         struct in_addr ip;
@@ -174,8 +195,7 @@ static void tcp_dns_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
         err_t e = udp_sendto(es->pcb, socksp, reinterpret_cast<const ip_addr_t *>(&ip), es->udp_port);
         pbuf_free(socksp);
 
-        free(buffer->buffer);
-        free(buffer);
+        response_pool.release(buffer);
 
         free_dns_query(watcher, es);
         if (e != ERR_OK) {
@@ -186,9 +206,8 @@ static void tcp_dns_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
 }
 
 static void
-timeout_cb(struct ev_loop *loop, ev_timer *watcher, int revents) {
-    udp_timer_ctx *timeout_ctx = container_of(watcher, udp_timer_ctx, watcher);
-    struct udp_raw_state *es = timeout_ctx->raw_state;
+timeout_cb(timer_wheel_node *node) {
+    struct udp_raw_state *es = container_of(node, struct udp_raw_state, timeout);
     printf("timeout, clean\n");
     free_dns_query(&(es->io), es);
 }
@@ -210,14 +229,20 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
 
     if (strcmp("tcp", conf->dns_mode) == 0 && upcb->remote_fake_port == 53) {
         printf("Redirect dns query to tcp via socks 5\n");
-        response *buffer = (response *) malloc(sizeof(response));
-        buffer->buffer = static_cast<char *>(malloc(UDP_BUFFER_SIZE));
+        response *buffer = response_pool.alloc();
         char *query;
 
+        if (buffer == NULL) {
+            printf("udp_raw_recv: out of memory for dns response\n");
+            pbuf_free(p);
+            return;
+        }
+
         pbuf_copy_partial(p, buffer->buffer, p->tot_len, 0);
 
         char *domain = get_query_domain(reinterpret_cast<const u_char *>(buffer->buffer), p->tot_len, stderr);
         if (domain == NULL) {
+            response_pool.release(buffer);
             return;
         }
 
@@ -230,8 +255,7 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
 
         if (blocked) {
             std::cout << cppdomain << " was blocked!!!" << std::endl;
-            free(buffer->buffer);
-            free(buffer);
+            response_pool.release(buffer);
             pbuf_free(p);
             return;
         }
@@ -254,18 +278,27 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
             localAddr.sin_port = htons(0);
             if (bind(dns_fd, (struct sockaddr *) &localAddr, sizeof(localAddr)) < 0) {
                 printf("bind udp relay failed\n");
+                close(dns_fd);
+                response_pool.release(buffer);
                 return;
             }
             int addr_len = sizeof(sockaddr_in);
             ssize_t nread = sendto(dns_fd, buffer->buffer, p->tot_len, 0, (struct sockaddr *) (&dns_addr),
                                    static_cast<socklen_t>(addr_len));
+            response_pool.release(buffer);
             if (nread < 0) {
                 printf("udp query sendto %s failed\n", dns_server.c_str());
+                close(dns_fd);
                 return;
             }
 
-            es = (struct udp_raw_state *) malloc(sizeof(struct udp_raw_state));
-            memset(es, 0, sizeof(struct udp_raw_state));
+            es = state_pool.alloc();
+            if (es == NULL) {
+                printf("udp_raw_recv: out of memory for udp_raw_state\n");
+                close(dns_fd);
+                pbuf_free(p);
+                return;
+            }
             es->pcb = upcb;
             es->state = 0;
             es->retries = 0;
@@ -276,12 +309,7 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
             es->addr_len = addr_len;
             es->socks_tcp_fd = 0;
 
-            es->timeout_ctx = (udp_timer_ctx *) malloc(sizeof(udp_timer_ctx));
-            memset(es->timeout_ctx, 0, sizeof(udp_timer_ctx));
-            es->timeout_ctx->raw_state = es;
-
-            ev_timer_init(&(es->timeout_ctx->watcher), timeout_cb, timeout, 0.);
-            ev_timer_start(EV_DEFAULT, &(es->timeout_ctx->watcher));
+            timer_wheel_arm(&es->timeout, UDP_RAW_TIMEOUT, timeout_cb);
 
             ev_io_init(&(es->io), dns_relay_cb, dns_fd, EV_READ);
             ev_io_start(EV_DEFAULT, &(es->io));
@@ -294,27 +322,45 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
         query[0] = 0;
         query[1] = (char) p->len;
         memcpy(query + 2, buffer->buffer, p->len);
+        response_pool.release(buffer);
 
-        int socks_fd = socks5_connect(conf->socks_server, conf->socks_port);
+        upstream *up = upstream_pick(inet_addr(conf->remote_dns_server));
+        int socks_fd = socks_pool_connect(up);
         if (socks_fd < 1) {
             printf("socks5 connect failed\n");
+            upstream_release(up);
+            free(query);
             return;
         }
 
         char dns_port[16];
         sprintf(dns_port, "%d", upcb->remote_fake_port);
 
-        int ret = socks5_auth(socks_fd, conf->remote_dns_server, dns_port, 0x01, 1);
+        int ret = socks5_request(socks_fd, conf->remote_dns_server, dns_port, 0x01, 1);
         if (ret < 0) {
             printf("socks5 auth failed\n");
+            if (ret == -1) {
+                upstream_failed(up);
+            }
+            upstream_release(up);
+            close(socks_fd);
+            free(query);
             return;
         }
 
         // forward dns query
         send(socks_fd, query, p->len + 2, 0);
-
-        es = (struct udp_raw_state *) malloc(sizeof(struct udp_raw_state));
-        memset(es, 0, sizeof(struct udp_raw_state));
+        up->bytes_up += p->len + 2;
+        free(query);
+
+        es = state_pool.alloc();
+        if (es == NULL) {
+            printf("udp_raw_recv: out of memory for udp_raw_state\n");
+            upstream_release(up);
+            close(socks_fd);
+            return;
+        }
+        es->up = up;
         es->pcb = upcb;
         es->state = 0;
         es->retries = 0;
@@ -325,18 +371,13 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
         struct sockaddr_in socks_proxy_addr;
 
         socks_proxy_addr.sin_family = AF_INET;
-        socks_proxy_addr.sin_addr.s_addr = inet_addr(conf->socks_server);
-        socks_proxy_addr.sin_port = htons(atoi(conf->socks_port));
+        socks_proxy_addr.sin_addr.s_addr = inet_addr(up->host);
+        socks_proxy_addr.sin_port = htons(atoi(up->port));
         es->addr = socks_proxy_addr;
         es->addr_len = addr_len;
         es->socks_tcp_fd = socks_fd;
 
-        es->timeout_ctx = (udp_timer_ctx *) malloc(sizeof(udp_timer_ctx));
-        memset(es->timeout_ctx, 0, sizeof(udp_timer_ctx));
-        es->timeout_ctx->raw_state = es;
-
-        ev_timer_init(&(es->timeout_ctx->watcher), timeout_cb, timeout, 0.);
-        ev_timer_start(EV_DEFAULT, &(es->timeout_ctx->watcher));
+        timer_wheel_arm(&es->timeout, UDP_RAW_TIMEOUT, timeout_cb);
 
         ev_io_init(&(es->io), tcp_dns_cb, socks_fd, EV_READ);
         ev_io_start(EV_DEFAULT, &(es->io));
@@ -384,6 +425,7 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
             localAddr.sin_port = htons(0);
             if (bind(dns_fd, (struct sockaddr *) &localAddr, sizeof(localAddr)) < 0) {
                 printf("bind udp relay failed\n");
+                close(dns_fd);
                 return;
             }
             int addr_len = sizeof(sockaddr_in);
@@ -393,11 +435,17 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
                                    static_cast<socklen_t>(addr_len));
             if (nread < 0) {
                 printf("udp query sendto %s failed\n", dns_server.c_str());
+                close(dns_fd);
                 return;
             }
 
-            es = (struct udp_raw_state *) malloc(sizeof(struct udp_raw_state));
-            memset(es, 0, sizeof(struct udp_raw_state));
+            es = state_pool.alloc();
+            if (es == NULL) {
+                printf("udp_raw_recv: out of memory for udp_raw_state\n");
+                close(dns_fd);
+                pbuf_free(p);
+                return;
+            }
             es->pcb = upcb;
             es->state = 0;
             es->retries = 0;
@@ -408,12 +456,7 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
             es->addr_len = addr_len;
             es->socks_tcp_fd = 0;
 
-            es->timeout_ctx = (udp_timer_ctx *) malloc(sizeof(udp_timer_ctx));
-            memset(es->timeout_ctx, 0, sizeof(udp_timer_ctx));
-            es->timeout_ctx->raw_state = es;
-
-            ev_timer_init(&(es->timeout_ctx->watcher), timeout_cb, timeout, 0.);
-            ev_timer_start(EV_DEFAULT, &(es->timeout_ctx->watcher));
+            timer_wheel_arm(&es->timeout, UDP_RAW_TIMEOUT, timeout_cb);
 
             ev_io_init(&(es->io), dns_relay_cb, dns_fd, EV_READ);
             ev_io_start(EV_DEFAULT, &(es->io));
@@ -431,40 +474,17 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
     }
 
 
-    es = (struct udp_raw_state *) malloc(sizeof(struct udp_raw_state));
-    memset(es, 0, sizeof(struct udp_raw_state));
-    es->pcb = upcb;
-    es->state = 0;
-    es->retries = 0;
-    es->udp_port = port;
-    inet_ntop(AF_INET, addr, es->addr_ip, INET_ADDRSTRLEN);
-
-    int socks_fd = socks5_connect(conf->socks_server, conf->socks_port);
+    /* connected and past the method exchange, from the warm pool if possible */
+    upstream *up = upstream_pick(ip4_addr_get_u32(&upcb->remote_fake_ip));
+    int socks_fd = socks_pool_connect(up);
     if (socks_fd < 1) {
         printf("socks5 connect failed\n");
+        upstream_release(up);
+        pbuf_free(p);
         return;
     }
 
     char buff[BUFFER_SIZE];
-    /**
-     * socks 5 method request start
-     */
-    ((socks5_method_req_t *) buff)->ver = SOCKS5_VERSION;
-    ((socks5_method_req_t *) buff)->nmethods = 0x01;
-    ((socks5_method_req_t *) buff)->methods[0] = 0x00;
-    send(socks_fd, buff, 3, 0);
-    // VERSION and METHODS
-    if (-1 == recv(socks_fd, buff, 2, 0)) {
-        printf("recv VERSION and METHODS error\n");
-        return;
-    };
-    if (SOCKS5_VERSION != ((socks5_method_res_t *) buff)->ver || 0x00 != ((socks5_method_res_t *) buff)->method) {
-        printf("socks5_method_res_t error\n");
-        return;
-    }
-    /**
-     * socks 5 method request end
-     */
 
     /**
      * socks 5 request start
@@ -512,10 +532,26 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
      */
     if (-1 == recv(socks_fd, buff, 10, 0)) {
         printf("recv socks 5 response error\n");
+        upstream_failed(up);
+        upstream_release(up);
+        close(socks_fd);
+        pbuf_free(p);
         return;
     };
     if (SOCKS5_VERSION != ((socks5_response_t *) buff)->ver) {
         printf("socks 5 response version error\n");
+        upstream_failed(up);
+        upstream_release(up);
+        close(socks_fd);
+        pbuf_free(p);
+        return;
+    }
+    if (0x00 != ((socks5_response_t *) buff)->cmd) {
+        /* e.g. no udp support, the server itself works */
+        printf("socks 5 udp associate refused, rep %d\n", ((socks5_response_t *) buff)->cmd);
+        upstream_release(up);
+        close(socks_fd);
+        pbuf_free(p);
         return;
     }
 
@@ -563,6 +599,10 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
     localAddr.sin_port = htons(0);
     if (bind(udp_relay_fd, (struct sockaddr *) &localAddr, sizeof(localAddr)) < 0) {
         printf("bind udp relay failed\n");
+        upstream_release(up);
+        close(udp_relay_fd);
+        close(socks_fd);
+        pbuf_free(p);
         return;
     }
     int addr_len = sizeof(sockaddr_in);
@@ -570,19 +610,35 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
                            static_cast<socklen_t>(addr_len));
     if (nread < 0) {
         printf("udp query sendto failed\n");
+        upstream_release(up);
+        close(udp_relay_fd);
+        close(socks_fd);
+        pbuf_free(p);
         return;
     }
-
+    up->bytes_up += nread;
+
+    /* only once the association is up, nothing above has to give it back */
+    es = state_pool.alloc();
+    if (es == NULL) {
+        printf("udp_raw_recv: out of memory for udp_raw_state\n");
+        upstream_release(up);
+        close(udp_relay_fd);
+        close(socks_fd);
+        pbuf_free(p);
+        return;
+    }
+    es->pcb = upcb;
+    es->state = 0;
+    es->retries = 0;
+    es->udp_port = port;
+    inet_ntop(AF_INET, addr, es->addr_ip, INET_ADDRSTRLEN);
+    es->up = up;
     es->addr = socks_proxy_addr;
     es->addr_len = addr_len;
     es->socks_tcp_fd = socks_fd;
 
-    es->timeout_ctx = (udp_timer_ctx *) malloc(sizeof(udp_timer_ctx));
-    memset(es->timeout_ctx, 0, sizeof(udp_timer_ctx));
-    es->timeout_ctx->raw_state = es;
-
-    ev_timer_init(&(es->timeout_ctx->watcher), timeout_cb, timeout, 0.);
-    ev_timer_start(EV_DEFAULT, &(es->timeout_ctx->watcher));
+    timer_wheel_arm(&es->timeout, UDP_RAW_TIMEOUT, timeout_cb);
 
     ev_io_init(&(es->io), udp_socks_relay_cb, udp_relay_fd, EV_READ);
     ev_io_start(EV_DEFAULT, &(es->io));
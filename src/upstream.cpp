@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "struct.h"
+#include "util.h"
+#include "var.h"
+#include "sys_clock.h"
+#include "relay_stats.h"
+#include "upstream.h"
+
+static upstream upstreams[UPSTREAM_MAX];
+static int count;
+static int policy = UP_ROUND_ROBIN;
+static int affinity;
+
+/* next server for round robin, and where least_conn starts looking */
+static int cursor;
+
+/* ms between probes of one server, 0 disables health checking */
+static u32_t health_interval;
+static u32_t health_fails;
+static u32_t health_rises;
+/* CONNECT target of the probes, the greeting only when NULL */
+static char *health_host;
+static char *health_port;
+static int health_atype;
+static int healthy;
+
+static void upstream_probe_cb(timer_wheel_node *node);
+
+static u32_t rand_state;
+
+static u32_t
+upstream_rand(void) {
+    /* xorshift32, placement only needs to be spread, not unpredictable */
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static int
+upstream_add(const char *host, const char *port) {
+    if (count == UPSTREAM_MAX) {
+        printf("socks_servers: more than %d servers, %s:%s ignored\n", UPSTREAM_MAX, host, port);
+        return -1;
+    }
+    upstream *up = &upstreams[count];
+    memset(up, 0, sizeof(upstream));
+    strncpy(up->host, host, sizeof(up->host) - 1);
+    strncpy(up->port, port, sizeof(up->port) - 1);
+    up->index = count++;
+    healthy++;
+    return 0;
+}
+
+void
+upstream_init(void) {
+    if (conf->socks_servers != NULL) {
+        std::vector<std::string> servers;
+        std::string list(conf->socks_servers);
+        std::string sp(";");
+        split(list, sp, &servers);
+        for (size_t i = 0; i < servers.size(); i++) {
+            std::string &s = servers.at(i);
+            size_t colon = s.rfind(':');
+            if (s.empty()) {
+                continue;
+            }
+            if (colon == std::string::npos) {
+                printf("socks_servers: %s has no port\n", s.c_str());
+                continue;
+            }
+            upstream_add(s.substr(0, colon).c_str(), s.substr(colon + 1).c_str());
+        }
+    }
+    if (count == 0 && conf->socks_server != NULL && conf->socks_port != NULL) {
+        upstream_add(conf->socks_server, conf->socks_port);
+    }
+    if (count == 0) {
+        printf("no socks server configured\n");
+        exit(1);
+    }
+
+    if (conf->socks_balance != NULL) {
+        if (strcmp(conf->socks_balance, "round_robin") == 0) {
+            policy = UP_ROUND_ROBIN;
+        } else if (strcmp(conf->socks_balance, "least_conn") == 0) {
+            policy = UP_LEAST_CONN;
+        } else if (strcmp(conf->socks_balance, "p2c") == 0) {
+            policy = UP_P2C;
+        } else if (strcmp(conf->socks_balance, "latency") == 0) {
+            policy = UP_LATENCY;
+        } else {
+            printf("socks_balance: unknown policy %s, using round_robin\n", conf->socks_balance);
+        }
+    }
+    affinity = conf->socks_affinity != NULL && strcmp(conf->socks_affinity, "true") == 0;
+    rand_state = (sys_clock_now() ^ ((u32_t) getpid() << 16)) | 1;
+
+    health_interval = (u32_t) conf_int(conf->socks_health_interval, 5000);
+    health_fails = (u32_t) LWIP_MAX(conf_int(conf->socks_health_fails, 3), 1);
+    health_rises = (u32_t) LWIP_MAX(conf_int(conf->socks_health_rises, 2), 1);
+    if (conf->socks_health_target != NULL) {
+        char *colon = strrchr(conf->socks_health_target, ':');
+        if (colon == NULL) {
+            printf("socks_health_target: %s has no port, probing with the greeting only\n", conf->socks_health_target);
+        } else {
+            health_host = strndup(conf->socks_health_target, colon - conf->socks_health_target);
+            health_port = strdup(colon + 1);
+            health_atype = inet_addr(health_host) != INADDR_NONE ? 1 : 3;
+        }
+    }
+    if (health_interval > 0) {
+        for (int i = 0; i < count; i++) {
+            /* spread over one interval, not all at once */
+            timer_wheel_arm(&upstreams[i].health, health_interval * (i + 1) / count, upstream_probe_cb);
+        }
+    }
+}
+
+int
+upstream_count(void) {
+    return count;
+}
+
+upstream *
+upstream_at(int i) {
+    return &upstreams[i];
+}
+
+/**
+ * servers new flows may go to, all of them when all are down: a server
+ * that might work beats none
+ */
+static int
+upstream_usable(upstream **usable) {
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (!upstreams[i].down || healthy == 0) {
+            usable[n++] = &upstreams[i];
+        }
+    }
+    if (healthy == 0) {
+        relay_stats.upstream_all_down++;
+    }
+    return n;
+}
+
+static upstream *
+upstream_least_conn(upstream **usable, int n) {
+    upstream *best = NULL;
+    /* from the cursor, so ties do not always land on the first server */
+    for (int i = 0; i < n; i++) {
+        upstream *up = usable[(cursor + i) % n];
+        if (best == NULL || up->active < best->active) {
+            best = up;
+        }
+    }
+    cursor = (cursor + 1) % count;
+    return best;
+}
+
+static upstream *
+upstream_p2c(upstream **usable, int n) {
+    upstream *a = usable[upstream_rand() % n];
+    upstream *b = usable[upstream_rand() % n];
+    return b->active < a->active ? b : a;
+}
+
+static upstream *
+upstream_latency_weighted(upstream **usable, int n) {
+    u32_t weights[UPSTREAM_MAX];
+    u32_t total = 0;
+
+    for (int i = 0; i < n; i++) {
+        /* not measured yet counts as fast, it gets measured soon enough */
+        u32_t ms8 = usable[i]->latency_ms8 > 8 ? usable[i]->latency_ms8 : 8;
+        weights[i] = 0x100000 / ms8;
+        total += weights[i];
+    }
+    u32_t r = upstream_rand() % total;
+    for (int i = 0; i < n; i++) {
+        if (r < weights[i]) {
+            return usable[i];
+        }
+        r -= weights[i];
+    }
+    return usable[n - 1];
+}
+
+upstream *
+upstream_pick(u32_t dest) {
+    upstream *usable[UPSTREAM_MAX];
+    upstream *up;
+
+    if (count == 1) {
+        up = &upstreams[0];
+    } else if (affinity) {
+        /* fibonacci hashing, neighbouring addresses spread over all servers */
+        int i = (int) (((uint64_t) (dest * 2654435769u) * (u32_t) count) >> 32);
+        /* the next one up while it is down, the others keep their flows */
+        for (int n = 0; n < count && upstreams[i].down && healthy > 0; n++) {
+            i = (i + 1) % count;
+        }
+        up = &upstreams[i];
+    } else {
+        int n = upstream_usable(usable);
+        switch (policy) {
+            case UP_LEAST_CONN:
+                up = upstream_least_conn(usable, n);
+                break;
+            case UP_P2C:
+                up = upstream_p2c(usable, n);
+                break;
+            case UP_LATENCY:
+                up = upstream_latency_weighted(usable, n);
+                break;
+            default:
+                up = usable[cursor % n];
+                cursor = (cursor + 1) % count;
+                break;
+        }
+    }
+    up->active++;
+    up->connections++;
+    return up;
+}
+
+upstream *
+upstream_pick_hedge(upstream *first) {
+    upstream *best = NULL;
+
+    for (int i = 0; i < count && !affinity; i++) {
+        upstream *up = &upstreams[i];
+        if (up == first || up->down) {
+            continue;
+        }
+        if (best == NULL || up->active < best->active) {
+            best = up;
+        }
+    }
+    if (best == NULL) {
+        /* a fresh socket to the same server, the slow one may be a lost SYN */
+        best = first;
+    }
+    best->active++;
+    best->connections++;
+    return best;
+}
+
+void
+upstream_release(upstream *up) {
+    if (up != NULL) {
+        up->active--;
+    }
+}
+
+void
+upstream_latency(upstream *up, u32_t ms) {
+    if (up->latency_ms8 == 0) {
+        up->latency_ms8 = ms * 8;
+    } else {
+        /* 1/8 of the new sample */
+        up->latency_ms8 += ms - (up->latency_ms8 >> 3);
+    }
+    up->fail_streak = 0;
+    up->ok_streak++;
+}
+
+void
+upstream_failed(upstream *up) {
+    up->failures++;
+    up->ok_streak = 0;
+    /* without probes nothing would bring it back */
+    if (++up->fail_streak >= health_fails && !up->down && health_interval > 0) {
+        printf("socks server %s:%s down after %u failures\n", up->host, up->port, up->fail_streak);
+        up->down = 1;
+        up->ejections++;
+        healthy--;
+        relay_stats.upstream_ejected++;
+    }
+}
+
+static void
+upstream_probe_done(socks5_handshake *hs, int ok) {
+    upstream *up = (upstream *) hs->data;
+
+    up->probing = 0;
+    if (!ok && hs->rep == 0) {
+        up->probe_failures++;
+        upstream_failed(up);
+        return;
+    }
+    /* a refused probe target still got a well formed reply */
+    if (ok) {
+        close(hs->fd);
+        hs->fd = -1;
+    }
+    upstream_latency(up, sys_clock_now() - hs->started);
+    if (up->down && up->ok_streak >= health_rises) {
+        printf("socks server %s:%s up again\n", up->host, up->port);
+        up->down = 0;
+        healthy++;
+        relay_stats.upstream_reinstated++;
+    }
+}
+
+static void
+upstream_probe_cb(timer_wheel_node *node) {
+    upstream *up = container_of(node, upstream, health);
+
+    timer_wheel_arm(&up->health, health_interval, upstream_probe_cb);
+    if (up->probing) {
+        /* still within its own handshake timeouts */
+        return;
+    }
+    up->probes++;
+    if (socks5_handshake_start(&up->probe, up->host, up->port, health_host, health_port, SOCKS5_CMD_CONNECT,
+                               health_atype, upstream_probe_done, NULL, up) < 0) {
+        up->probe_failures++;
+        upstream_failed(up);
+        return;
+    }
+    up->probing = 1;
+}
+
+void
+upstream_display(void) {
+    printf("\nSOCKS UPSTREAMS\n");
+    for (int i = 0; i < count; i++) {
+        upstream *up = &upstreams[i];
+        printf("\t%s:%s %s, active %u, connections %llu, failures %llu, up %llu bytes, down %llu bytes, latency %.1f ms\n",
+               up->host, up->port, up->down ? "DOWN" : "up", up->active, (unsigned long long) up->connections,
+               (unsigned long long) up->failures, (unsigned long long) up->bytes_up,
+               (unsigned long long) up->bytes_down, up->latency_ms8 / 8.);
+        printf("\t\tprobes %llu, probe failures %llu, ejections %llu\n", (unsigned long long) up->probes,
+               (unsigned long long) up->probe_failures, (unsigned long long) up->ejections);
+    }
+}
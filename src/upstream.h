@@ -0,0 +1,92 @@
+#ifndef IP2SOCKS_UPSTREAM_H
+#define IP2SOCKS_UPSTREAM_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "lwip/arch.h"
+#include "socks5.h"
+#include "timer_wheel.h"
+
+/* most socks servers in socks_servers */
+#define UPSTREAM_MAX 16
+
+enum upstream_policies {
+    UP_ROUND_ROBIN = 0,
+    UP_LEAST_CONN,
+    UP_P2C,     /* the less busy of two picked at random */
+    UP_LATENCY  /* random, weighted by the inverse of the handshake latency */
+};
+
+typedef struct upstream {
+    char host[INET_ADDRSTRLEN];
+    char port[8];
+    int index;
+    /* relays placed here and not yet released */
+    u32_t active;
+    /* handshake latency in ms, exponentially weighted, times 8 */
+    u32_t latency_ms8;
+    uint64_t connections;
+    uint64_t failures;
+    uint64_t bytes_up;
+    uint64_t bytes_down;
+    /* ejected, new flows go elsewhere until probes succeed again */
+    u8_t down;
+    /* consecutive failed / succeeded probes and handshakes */
+    u32_t fail_streak;
+    u32_t ok_streak;
+    uint64_t ejections;
+    uint64_t probes;
+    uint64_t probe_failures;
+    /* background health probe, see upstream_probe_cb */
+    socks5_handshake probe;
+    timer_wheel_node health;
+    u8_t probing;
+} upstream;
+
+/**
+ * Reads socks_servers, a ';' separated list of host:port, or the single
+ * socks_server / socks_port when it is not set, and the placement policy
+ * socks_balance: round_robin, least_conn, p2c or latency. With
+ * socks_affinity: true a destination ip always maps to the same server.
+ *
+ * Every socks_health_interval ms each server is probed in the background,
+ * with the greeting or a CONNECT to socks_health_target. After
+ * socks_health_fails failures in a row, probes or real handshakes, it is
+ * ejected and new flows skip it, socks_health_rises successful probes in
+ * a row bring it back.
+ */
+void upstream_init(void);
+
+int upstream_count(void);
+
+upstream *upstream_at(int i);
+
+/**
+ * place a new flow to dest (network order), counted as active until
+ * upstream_release. Ejected servers are skipped unless all of them are.
+ */
+upstream *upstream_pick(u32_t dest);
+
+/**
+ * place a second attempt racing one on first: the least busy other server
+ * that is up, first itself with socks_affinity or when there is none
+ */
+upstream *upstream_pick_hedge(upstream *first);
+
+void upstream_release(upstream *up);
+
+/**
+ * a socks handshake to up succeeded after ms
+ */
+void upstream_latency(upstream *up, u32_t ms);
+
+/**
+ * a connection or handshake to up failed
+ */
+void upstream_failed(upstream *up);
+
+void upstream_display(void);
+
+#endif //IP2SOCKS_UPSTREAM_H
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <vector>
+#include <stdlib.h>
 
 // 注意：当字符串为空时，也会返回一个空字符串
 void split(std::string &s, std::string &delim, std::vector<std::string> *ret) {
@@ -63,3 +64,11 @@ void match_dns_rule(std::vector<std::vector<std::string> > &domains, std::string
         }
     }
 }
+
+// 配置项未设置时返回默认值
+int conf_int(const char *value, int def) {
+    if (value == NULL || *value == '\0') {
+        return def;
+    }
+    return atoi(value);
+}
@@ -8,3 +8,5 @@ bool end_with(const std::string &str, const std::string &suffix);
 
 void match_dns_rule(std::vector<std::vector<std::string>> &domains, std::string &domain, bool *matched,
                     std::string *dns_server, bool *blocked);
+
+int conf_int(const char *value, int def);
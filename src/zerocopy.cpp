@@ -0,0 +1,261 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ev.h"
+
+#include "struct.h"
+#include "util.h"
+#include "var.h"
+#include "relay_stats.h"
+#include "object_pool.h"
+#include "timer_wheel.h"
+#include "zerocopy.h"
+
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+/* older libc headers */
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+#define ZEROCOPY_SUPPORTED 1
+#endif
+
+/* how long a closed socket is kept for the completions of its sends, ms */
+#define ZEROCOPY_DRAIN_TIMEOUT 10000
+
+/* bytes, 0 is off */
+static u32_t threshold;
+
+static object_pool<zerocopy_pin> pin_pool("zerocopy pin");
+
+/**
+ * a closed relay's socket, kept open until the kernel is done with its pbufs
+ */
+typedef struct zerocopy_drain {
+    ev_io io;
+    timer_wheel_node deadline;
+    int fd;
+    zerocopy_state zs;
+} zerocopy_drain;
+
+static object_pool<zerocopy_drain> drain_pool("zerocopy drain");
+
+void
+zerocopy_init(void) {
+    threshold = (u32_t) conf_int(conf->zerocopy_threshold, 0);
+#ifndef ZEROCOPY_SUPPORTED
+    if (threshold > 0) {
+        printf("zerocopy_threshold: MSG_ZEROCOPY is not supported on this system\n");
+        threshold = 0;
+    }
+#endif
+}
+
+void
+zerocopy_enable(zerocopy_state *zs, int fd) {
+#ifdef ZEROCOPY_SUPPORTED
+    int one = 1;
+    if (threshold == 0) {
+        return;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        /* kernel before 4.14 */
+        printf("setsockopt SO_ZEROCOPY failed: %s, zero copy sends off\n", strerror(errno));
+        threshold = 0;
+        return;
+    }
+    zs->enabled = 1;
+#endif
+}
+
+int
+zerocopy_wanted(const zerocopy_state *zs, u32_t len) {
+    return zs->enabled && len >= threshold;
+}
+
+static void
+zerocopy_unpin(zerocopy_pin *pin) {
+    for (u16_t i = 0; i < pin->n; i++) {
+        pbuf_free(pin->p[i]);
+    }
+    pin_pool.release(pin);
+}
+
+ssize_t
+zerocopy_sendmsg(zerocopy_state *zs, int fd, struct msghdr *msg, struct pbuf **pbufs) {
+#ifdef ZEROCOPY_SUPPORTED
+    zerocopy_pin *pin = pin_pool.alloc();
+    if (pin != NULL && msg->msg_iovlen <= ZEROCOPY_PIN_MAX) {
+        ssize_t ret = sendmsg(fd, msg, MSG_ZEROCOPY);
+        if (ret >= 0) {
+            pin->id = zs->next_id++;
+            pin->n = (u16_t) msg->msg_iovlen;
+            for (u16_t i = 0; i < pin->n; i++) {
+                pbuf_ref(pbufs[i]);
+                pin->p[i] = pbufs[i];
+            }
+            if (zs->pins_last != NULL) {
+                zs->pins_last->next = pin;
+            } else {
+                zs->pins = pin;
+            }
+            zs->pins_last = pin;
+            relay_stats.zerocopy_sends++;
+            relay_stats.zerocopy_bytes += ret;
+            return ret;
+        }
+        pin_pool.release(pin);
+        if (errno != ENOBUFS) {
+            return ret;
+        }
+        /* over the optmem limit for pinned pages, copy this one */
+        relay_stats.zerocopy_fallbacks++;
+    } else {
+        pin_pool.release(pin);
+        relay_stats.zerocopy_fallbacks++;
+    }
+#endif
+    return sendmsg(fd, msg, 0);
+}
+
+/**
+ * free the pins of sends lo to hi, ids wrap around
+ */
+static void
+zerocopy_complete(zerocopy_state *zs, u32_t lo, u32_t hi) {
+    zerocopy_pin **pp = &zs->pins;
+    zerocopy_pin *last = NULL;
+
+    while (*pp != NULL) {
+        zerocopy_pin *pin = *pp;
+        if (pin->id - lo <= hi - lo) {
+            *pp = pin->next;
+            zerocopy_unpin(pin);
+            relay_stats.zerocopy_completions++;
+        } else {
+            last = pin;
+            pp = &pin->next;
+        }
+    }
+    zs->pins_last = last;
+}
+
+void
+zerocopy_reap(zerocopy_state *zs, int fd) {
+#ifdef ZEROCOPY_SUPPORTED
+    while (zerocopy_pending(zs)) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            /* EAGAIN, nothing completed yet */
+            return;
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            struct sock_extended_err *ee = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                /* the kernel copied after all, e.g. over loopback */
+                relay_stats.zerocopy_copied += ee->ee_data - ee->ee_info + 1;
+            }
+            zerocopy_complete(zs, ee->ee_info, ee->ee_data);
+        }
+    }
+#endif
+}
+
+static void
+zerocopy_drain_done(zerocopy_drain *d) {
+    ev_io_stop(EV_DEFAULT, &d->io);
+    timer_wheel_cancel(&d->deadline);
+    close(d->fd);
+    /* whatever is left is past the deadline, the connection is beyond help */
+    while (d->zs.pins != NULL) {
+        zerocopy_pin *pin = d->zs.pins;
+        d->zs.pins = pin->next;
+        zerocopy_unpin(pin);
+    }
+    drain_pool.release(d);
+}
+
+static void
+zerocopy_drain_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
+    zerocopy_drain *d = container_of(watcher, zerocopy_drain, io);
+    char buf[BUFFER_SIZE];
+
+    zerocopy_reap(&d->zs, d->fd);
+    if (!zerocopy_pending(&d->zs)) {
+        zerocopy_drain_done(d);
+        return;
+    }
+    for (;;) {
+        /* the relay is gone, discard the server's data */
+        ssize_t n = recv(d->fd, buf, sizeof(buf), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if (n <= 0) {
+            /* readable for good from now on, wait for the deadline */
+            ev_io_stop(EV_DEFAULT, &d->io);
+            return;
+        }
+    }
+}
+
+static void
+zerocopy_drain_timeout_cb(timer_wheel_node *node) {
+    zerocopy_drain *d = container_of(node, zerocopy_drain, deadline);
+    zerocopy_reap(&d->zs, d->fd);
+    zerocopy_drain_done(d);
+}
+
+void
+zerocopy_close(zerocopy_state *zs, int fd) {
+    zerocopy_drain *d;
+
+    zerocopy_reap(zs, fd);
+    if (!zerocopy_pending(zs) || (d = drain_pool.alloc()) == NULL) {
+        close(fd);
+        while (zs->pins != NULL) {
+            zerocopy_pin *pin = zs->pins;
+            zs->pins = pin->next;
+            zerocopy_unpin(pin);
+        }
+        zs->pins_last = NULL;
+        return;
+    }
+
+    /* the server still sees the end of the upload like after close */
+    shutdown(fd, SHUT_WR);
+    d->fd = fd;
+    d->zs = *zs;
+    zs->pins = NULL;
+    zs->pins_last = NULL;
+    /* error queue notifications wake EV_READ watchers */
+    ev_io_init(&d->io, zerocopy_drain_cb, fd, EV_READ);
+    ev_io_start(EV_DEFAULT, &d->io);
+    timer_wheel_arm(&d->deadline, ZEROCOPY_DRAIN_TIMEOUT, zerocopy_drain_timeout_cb);
+}
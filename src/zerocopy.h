@@ -0,0 +1,72 @@
+#ifndef IP2SOCKS_ZEROCOPY_H
+#define IP2SOCKS_ZEROCOPY_H
+
+#include <sys/socket.h>
+
+#include "lwip/pbuf.h"
+
+/* most pbufs pinned by one sendmsg */
+#define ZEROCOPY_PIN_MAX 64
+
+/**
+ * pbufs handed to one MSG_ZEROCOPY sendmsg, referenced until the kernel
+ * reports send id done on the socket's error queue
+ */
+typedef struct zerocopy_pin {
+    struct zerocopy_pin *next;
+    u32_t id;
+    u16_t n;
+    struct pbuf *p[ZEROCOPY_PIN_MAX];
+} zerocopy_pin;
+
+/**
+ * per socket state, zeroed memory is a socket with zero copy off
+ */
+typedef struct zerocopy_state {
+    u8_t enabled;
+    /* id the kernel gives the next MSG_ZEROCOPY send */
+    u32_t next_id;
+    /* oldest first */
+    zerocopy_pin *pins;
+    zerocopy_pin *pins_last;
+} zerocopy_state;
+
+/**
+ * Opt-in MSG_ZEROCOPY sends to the socks server, used for writes of at
+ * least zerocopy_threshold bytes. Linux only, a no-op elsewhere.
+ */
+void zerocopy_init(void);
+
+/**
+ * set SO_ZEROCOPY on fd if zero copy sends are configured
+ */
+void zerocopy_enable(zerocopy_state *zs, int fd);
+
+/**
+ * @return whether a write of len bytes should be sent zero copy
+ */
+int zerocopy_wanted(const zerocopy_state *zs, u32_t len);
+
+/**
+ * sendmsg with MSG_ZEROCOPY, on success the pbufs behind the iovecs of msg
+ * are referenced until their completion. Falls back to a copying send when
+ * the kernel is out of memory for pinning.
+ */
+ssize_t zerocopy_sendmsg(zerocopy_state *zs, int fd, struct msghdr *msg, struct pbuf **pbufs);
+
+static inline int zerocopy_pending(const zerocopy_state *zs) {
+    return zs->pins != NULL;
+}
+
+/**
+ * read completions from the error queue of fd and free the pbufs they release
+ */
+void zerocopy_reap(zerocopy_state *zs, int fd);
+
+/**
+ * Close fd. The kernel may still read pinned pbufs, with sends pending the
+ * socket is shut down for writing and kept until they complete.
+ */
+void zerocopy_close(zerocopy_state *zs, int fd);
+
+#endif //IP2SOCKS_ZEROCOPY_H